@@ -0,0 +1,385 @@
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include "game.h"
+#include "mcts.h"
+
+using Clock = chrono::steady_clock;
+
+#if defined(__clang__)
+#define COMPILER_NAME "clang " __clang_version__
+#elif defined(__GNUC__)
+#define COMPILER_NAME "gcc " __VERSION__
+#elif defined(_MSC_VER)
+#define COMPILER_NAME "msvc"
+#else
+#define COMPILER_NAME "unknown"
+#endif
+
+struct BenchPosition
+{
+	const char *name;
+	const char *moves;
+};
+
+// fixed positions for search, all of them are out of book
+const BenchPosition BENCH_POSITIONS[] =
+{
+	{ "opening", "H8 I9 I7 Ha K7 G9" },
+	{ "middle", "H8 I9 I7 Ha I6 G9 F8 Ga G8 I8 H9 Gc Fc Ia" },
+	{ "threat", "H8 I9 I7 Ha K7 G9 H6 H9 F9 K9 J9 Ib F8 Ja L8 Ia" },
+};
+
+struct BenchConfig
+{
+	int gameNum = 2000; // random games for board and playout benchmarks
+	int moveTime = 1000; // time per search in milliseconds
+	int threadMax = 0;
+	int treeNum = 1; // independent trees in search, see MCTS::SetTreeNum
+	bool pin = false; // pin search threads to cpus
+	const char *jsonFile = "bench.json";
+};
+
+class Benchmark
+{
+public:
+	Benchmark(const BenchConfig &config);
+	void Run();
+
+private:
+	void GenerateGames();
+	void BenchPutChess();
+	void BenchUpdateScoreInfo();
+	void BenchUpdateGridsInfo();
+	void BenchLineScore();
+	void BenchDefaultPolicy();
+	void BenchSearch();
+	void WriteJson();
+
+	static float GetSeconds(Clock::time_point start);
+	static void SetupGame(Game &game, const char *moves);
+
+	struct SearchResult
+	{
+		string position;
+		int threadNum;
+		float seconds;
+		int iterations;
+		size_t nodes;
+		string bestMove;
+		SearchStats stats;
+	};
+
+	BenchConfig config;
+	vector<vector<uint8_t>> games; // random games, replayed by board benchmarks
+	long long moveCount;
+	float putChessNs, updateScoreInfoNs, updateGridsInfoNs, lineScoreNs;
+	int lineScoreSum;
+	float playoutPerSecond, playoutMoveNum;
+	vector<SearchResult> searchResults;
+};
+
+Benchmark::Benchmark(const BenchConfig &config)
+{
+	this->config = config;
+
+	if (this->config.threadMax <= 0)
+		this->config.threadMax = max((int)thread::hardware_concurrency(), 1);
+
+	this->config.threadMax = min(this->config.threadMax, THREAD_NUM_MAX);
+}
+
+float Benchmark::GetSeconds(Clock::time_point start)
+{
+	return chrono::duration<float>(Clock::now() - start).count();
+}
+
+void Benchmark::SetupGame(Game &game, const char *moves)
+{
+	string str(moves);
+	for (size_t pos = 0; pos < str.size(); pos += 3)
+		game.PutChess(Game::Str2Id(str.substr(pos, 2)));
+}
+
+void Benchmark::Run()
+{
+	GenerateGames();
+
+	BenchPutChess();
+	BenchUpdateScoreInfo();
+	BenchUpdateGridsInfo();
+	BenchLineScore();
+	BenchDefaultPolicy();
+	BenchSearch();
+
+	WriteJson();
+}
+
+void Benchmark::GenerateGames()
+{
+	Random random;
+	random.Seed(1);
+
+	games.resize(config.gameNum);
+	moveCount = 0;
+
+	for (auto &record : games)
+	{
+		GameBase game;
+		while (game.state == GameBase::E_NORMAL)
+		{
+			int move = game.GetNextMove(random);
+			game.PutChess(move);
+			record.push_back(move);
+		}
+		moveCount += record.size();
+	}
+}
+
+void Benchmark::BenchPutChess()
+{
+	auto start = Clock::now();
+
+	for (auto &record : games)
+	{
+		GameBase game;
+		for (int move : record)
+			game.PutChess(move);
+	}
+
+	putChessNs = GetSeconds(start) * 1e9f / moveCount;
+	printf("PutChess: %.0f ns\n", putChessNs);
+}
+
+void Benchmark::BenchUpdateScoreInfo()
+{
+	auto start = Clock::now();
+
+	for (auto &record : games)
+	{
+		Board board;
+		for (int i = 0; i < record.size(); ++i)
+		{
+			int turn = i + 1;
+			board.grids[record[i]] = (turn % 2 == 1) ? Board::E_BLACK : Board::E_WHITE;
+			board.UpdatScoreInfo(record[i], turn);
+		}
+	}
+
+	updateScoreInfoNs = GetSeconds(start) * 1e9f / moveCount;
+	printf("UpdatScoreInfo: %.0f ns\n", updateScoreInfoNs);
+}
+
+void Benchmark::BenchUpdateGridsInfo()
+{
+	const int REPEAT = 8;
+	float seconds = 0;
+
+	for (auto &record : games)
+	{
+		GameBase game;
+		for (int move : record)
+		{
+			game.PutChess(move);
+
+			auto start = Clock::now();
+			for (int i = 0; i < REPEAT; ++i)
+				game.board.UpdateGridsInfo(i % 2);
+			seconds += GetSeconds(start);
+
+			game.board.UpdateGridsInfo(game.GetSide() == Board::E_BLACK ? 0 : 1); // restore the side to move
+		}
+	}
+
+	updateGridsInfoNs = seconds * 1e9f / (moveCount * REPEAT);
+	printf("UpdateGridsInfo: %.0f ns\n", updateGridsInfoNs);
+}
+
+void Benchmark::BenchLineScore()
+{
+	// keys of lines through every move of the games, in random order
+	vector<int> keys;
+	for (auto &record : games)
+	{
+		GameBase game;
+		for (int move : record)
+		{
+			game.PutChess(move);
+			for (int i = 0; i < 4; ++i)
+				keys.push_back(game.board.GetLineKey(move, i));
+		}
+	}
+
+	size_t keyNum = 1;
+	while (keyNum * 2 <= keys.size())
+		keyNum *= 2;
+
+	Random random;
+	random.Seed(1);
+	for (size_t i = keyNum - 1; i > 0; --i)
+		swap(keys[i], keys[random.Next(i + 1)]);
+
+	// each lookup depends on the last one, so this is latency instead of throughput
+	const int LOOKUP_NUM = 1 << 24;
+	size_t index = 0;
+	int sum = 0;
+	auto start = Clock::now();
+
+	for (int i = 0; i < LOOKUP_NUM; ++i)
+	{
+		int score = Board::GetLineScore(keys[index]);
+		sum += score;
+		index = (index + 1 + (score & 1)) & (keyNum - 1);
+	}
+
+	lineScoreNs = GetSeconds(start) * 1e9f / LOOKUP_NUM;
+	lineScoreSum = sum;
+	printf("GetLineScore: %.2f ns\n", lineScoreNs);
+}
+
+void Benchmark::BenchDefaultPolicy()
+{
+	MCTS mcts;
+	mcts.randomCache[0].Seed(1);
+
+	int playoutNum = 0;
+	int turnNum = 0;
+	auto start = Clock::now();
+
+	for (auto &position : BENCH_POSITIONS)
+	{
+		Game game;
+		SetupGame(game, position.moves);
+
+		mcts.searchSide = game.GetTurn() % 2 == 1 ? Board::E_BLACK : Board::E_WHITE;
+
+		for (int i = 0; i < config.gameNum; ++i)
+		{
+			mcts.gameCache[0] = *((GameBase*)&game);
+			mcts.DefaultPolicy(NULL, 0);
+
+			turnNum += mcts.gameCache[0].turn - game.GetTurn();
+			++playoutNum;
+		}
+	}
+
+	float seconds = GetSeconds(start);
+	playoutPerSecond = playoutNum / seconds;
+	playoutMoveNum = (float)turnNum / playoutNum;
+	printf("DefaultPolicy: %.0f playouts/s, %.1f moves per playout\n", playoutPerSecond, playoutMoveNum);
+}
+
+void Benchmark::BenchSearch()
+{
+	vector<int> threadNums;
+	for (int i = 1; i < config.threadMax; i *= 2)
+		threadNums.push_back(i);
+	threadNums.push_back(config.threadMax);
+
+	for (auto &position : BENCH_POSITIONS)
+	{
+		for (int threadNum : threadNums)
+		{
+			Game game;
+			SetupGame(game, position.moves);
+
+			// new engine for every search, so no tree is reused
+			MCTS mcts;
+			mcts.SetSeed(1);
+			mcts.SetThreadNum(threadNum);
+			mcts.SetTreeNum(config.treeNum);
+			mcts.SetThreadAffinity(config.pin);
+
+			SearchResult result;
+
+			auto start = Clock::now();
+			int move = mcts.Search(&game, TimeBudget(config.moveTime), &result.stats);
+
+			result.position = position.name;
+			result.threadNum = threadNum;
+			result.seconds = GetSeconds(start);
+			result.iterations = result.stats.iterations; // 0 for book and threat solver moves, which return without a tree
+			result.nodes = mcts.nodes->Size();
+			result.bestMove = Game::Id2Str(move);
+			searchResults.push_back(result);
+
+			printf("Search %s, %d threads: %.0f iterations/s\n", position.name, threadNum, result.iterations / result.seconds);
+		}
+	}
+}
+
+void Benchmark::WriteJson()
+{
+	FILE *fp = fopen(config.jsonFile, "w");
+	if (fp == NULL)
+	{
+		printf("can not open %s\n", config.jsonFile);
+		return;
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"build\": { \"compiler\": \"%s\", \"restricted_move_rule\": %s, \"thread_max\": %d, \"trees\": %d, \"pin\": %s, \"compact_line_table\": %s },\n",
+		COMPILER_NAME, Board::RestrictedMoveRule ? "true" : "false", config.threadMax, config.treeNum, config.pin ? "true" : "false",
+		COMPACT_LINE_TABLE ? "true" : "false");
+	fprintf(fp, "  \"board\": { \"games\": %d, \"moves\": %lld, \"put_chess_ns\": %.1f, \"update_score_info_ns\": %.1f, \"update_grids_info_ns\": %.1f, \"line_score_ns\": %.2f },\n",
+		config.gameNum, moveCount, putChessNs, updateScoreInfoNs, updateGridsInfoNs, lineScoreNs);
+	fprintf(fp, "  \"playout\": { \"playouts_per_sec\": %.1f, \"moves_per_playout\": %.2f },\n", playoutPerSecond, playoutMoveNum);
+	fprintf(fp, "  \"search\": [\n");
+
+	for (size_t i = 0; i < searchResults.size(); ++i)
+	{
+		const SearchResult &result = searchResults[i];
+		const SearchStats &stats = result.stats;
+
+		fprintf(fp, "    { \"position\": \"%s\", \"threads\": %d, \"seconds\": %.3f, \"iterations\": %d, \"iterations_per_sec\": %.1f, \"nodes\": %zu, \"best_move\": \"%s\",\n",
+			result.position.c_str(), result.threadNum, result.seconds, result.iterations, result.iterations / result.seconds,
+			result.nodes, result.bestMove.c_str());
+		fprintf(fp, "      \"phase_ms\": { \"select\": %.1f, \"expand\": %.1f, \"rollout\": %.1f, \"update\": %.1f, \"lock_wait\": %.1f },\n",
+			stats.selectTime / 1e6, stats.expandTime / 1e6, stats.rolloutTime / 1e6, stats.updateTime / 1e6, stats.lockWaitTime / 1e6);
+		fprintf(fp, "      \"node_count\": %d, \"node_alloc_fail\": %d, \"trans_hit\": %d, \"trans_miss\": %d, \"expand_collision\": %d, \"fast_stop_count\": %d,\n",
+			stats.nodeCount, stats.nodeAllocFail, stats.transHit, stats.transMiss, stats.expandCollision, stats.fastStopCount);
+		fprintf(fp, "      \"solver_count\": %d, \"solver_win\": %d,\n", stats.solverCount, stats.solverWin);
+		fprintf(fp, "      \"rollout_length\": [");
+		for (int j = 0; j < ROLLOUT_HISTOGRAM_SIZE; ++j)
+			fprintf(fp, (j == 0) ? "%d" : ", %d", stats.rolloutLength[j]);
+		fprintf(fp, "] }%s\n", (i + 1 < searchResults.size()) ? "," : "");
+	}
+
+	fprintf(fp, "  ]\n");
+	fprintf(fp, "}\n");
+	fclose(fp);
+
+	printf("results written to %s\n", config.jsonFile);
+}
+
+int main(int argc, char *argv[])
+{
+	BenchConfig config;
+
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "--games") == 0)
+			config.gameNum = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--time") == 0)
+			config.moveTime = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--threads") == 0)
+			config.threadMax = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--trees") == 0)
+			config.treeNum = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--pin") == 0)
+			config.pin = atoi(argv[i + 1]) != 0;
+		else if (strcmp(argv[i], "--json") == 0)
+			config.jsonFile = argv[i + 1];
+		else
+		{
+			printf("usage: gobang_bench [--games N] [--time ms] [--threads N] [--trees N] [--pin 0|1] [--json file]\n");
+			return 1;
+		}
+	}
+
+	Benchmark benchmark(config);
+	benchmark.Run();
+
+	return 0;
+}
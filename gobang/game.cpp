@@ -1,4 +1,5 @@
 #include "game.h"
+#include "log.h"
 #include <cstdlib>
 #include <cassert>
 #include <cmath>
@@ -11,36 +12,116 @@
 #define USE_BEAUTIFUL_BOARD 1
 #define OUTPUT_LINE_SCORE_DICT 0
 #define OUTPUT_RESTRICTED_SCORE 0
-#define ENABLE_KEY_OPTIMIZATION 1
 
-bool Board::RestrictedMoveRule = false;
+void GridSet::Fill()
+{
+	bits.fill(~0ull);
+	bits[3] = (1ull << (GRID_NUM - 192)) - 1;
+}
+
+int GridSet::Last() const
+{
+	for (int i = 3; i >= 0; --i)
+	{
+		if (bits[i] != 0)
+			return i * 64 + HighestBit(bits[i]);
+	}
+	return -1;
+}
+
+int GridSet::ToArray(array<uint8_t, GRID_NUM> &result) const
+{
+	int count = 0;
+	ForEach([&](int id)
+	{
+		result[count++] = id;
+	});
+	return count;
+}
+
+GridSet& GridSet::operator|=(const GridSet &other)
+{
+	for (int i = 0; i < 4; ++i)
+		bits[i] |= other.bits[i];
+	return *this;
+}
+
+GridSet GridSet::operator&(const GridSet &other) const
+{
+	GridSet result;
+	for (int i = 0; i < 4; ++i)
+		result.bits[i] = bits[i] & other.bits[i];
+	return result;
+}
 
-bool Board::isLineScoreDictReady = false;
+GridSet GridSet::operator~() const
+{
+	GridSet result;
+	for (int i = 0; i < 4; ++i)
+		result.bits[i] = ~bits[i];
+	return result;
+}
+
+once_flag Board::isTablesReady;
+
+#if COMPACT_LINE_TABLE
+array<uint16_t, 256> Board::lineLeftIndex;
+array<uint16_t, 1024> Board::lineRightIndex;
+array<short, LINE_PATTERN_NUM> Board::linePatternScore;
+#else
 array<int, LINE_ID_MAX> Board::lineScoreDict;
+#endif
+
+array<array<uint32_t, LINE_NUM_MAX>, 4> Board::lineBitsOrigin;
+array<array<uint8_t, GRID_NUM>, 4> Board::lineIndex;
+array<array<uint8_t, GRID_NUM>, 4> Board::linePos;
+array<int, 512> Board::lineKeySpread;
+
+// id offset of one step along each key group, same as E_LEFT, E_UP, E_UP_LEFT, E_UP_RIGHT
+const int KEY_GROUP_STEP[4] = { -1, -BOARD_SIZE, -BOARD_SIZE - 1, -BOARD_SIZE + 1 };
 
-bool Board::isKeyInfoOriginReady = false;
-array<array<int, GRID_NUM>, 4> Board::keyInfoOrigin;
+array<array<uint64_t, GRID_NUM>, 2> Board::zobristKey;
 
 Board::Board()
 {
-	if (!isLineScoreDictReady)
-		InitLineScoreDict();
-
+	call_once(isTablesReady, InitTables);
 	Clear();
 }
 
+void Board::InitTables()
+{
+	InitLineScoreDict();
+	InitZobristKey();
+	InitLineBits();
+}
+
 void Board::Clear()
 {
 	hashKey = 0;
 	grids.fill(E_EMPTY);
 	scoreInfo[0].fill(0);
 	scoreInfo[1].fill(0);
-	gridCheckStatus.fill(E_PRIORITY_MAX);
 
-	if (ENABLE_KEY_OPTIMIZATION)
+	for (int i = 0; i < 2; ++i)
 	{
-		InitKeyInfo();
+		gridType[i].fill(E_OTHER);
+		for (auto &gridSet : gridTypeSet[i])
+			gridSet.Clear();
+
+		gridTypeSet[i][E_OTHER - E_RESTRICTED].Fill();
+		fixedGrids[i].Clear();
 	}
+
+	for (auto &gridSet : prioritySet)
+		gridSet.Clear();
+
+	keyGrid = 0xff;
+	hasPriority.fill(false);
+	hasPriority[E_LOWEST] = true;
+	prioritySet[E_LOWEST].Fill();
+
+	lineBits[0] = lineBitsOrigin;
+	lineBits[1] = lineBitsOrigin;
 }
 
 void Board::TestPrint()
@@ -132,8 +213,11 @@ void Board::PrintNew(int lastChess)
 }
 
 
-void Board::Print(int lastChess, bool isLog)
+void Board::Print(int lastChess, FILE *fp)
 {
+	bool isLog = (fp != NULL); // log to file, otherwise print to console
+	FILE *out = isLog ? fp : stdout;
+
 	if (USE_BEAUTIFUL_BOARD && !isLog)
 	{
 		PrintNew(lastChess);
@@ -142,19 +226,19 @@ void Board::Print(int lastChess, bool isLog)
 
 	const char *format = (isLog ? "%c  " : "%c ");
 
-	cout << (isLog ? "   " : "  ");
+	fprintf(out, isLog ? "   " : "  ");
 	for (int i = 0; i < BOARD_SIZE; ++i)
 	{
-		printf(format, 'A' + i);
+		fprintf(out, format, 'A' + i);
 	}
-	cout << endl;
+	fprintf(out, "\n");
 
 	for (int i = 0; i < BOARD_SIZE; ++i)
 	{
 		if (i < 9)
-			printf(format, '1' + i);
+			fprintf(out, format, '1' + i);
 		else
-			printf(format, 'a' + i - 9);
+			fprintf(out, format, 'a' + i - 9);
 
 		for (int j = 0; j < BOARD_SIZE; ++j)
 		{
@@ -163,45 +247,47 @@ void Board::Print(int lastChess, bool isLog)
 
 			if (id == lastChess)
 			{
-				printf(format, grid == E_BLACK ? 'B' : 'W');
+				fprintf(out, format, grid == E_BLACK ? 'B' : 'W');
 				continue;
 			}
 
 			if (grid == E_EMPTY)
 			{
-				printf(format, '-');
+				fprintf(out, format, '-');
 			}
 			if (grid == E_BLACK)
 			{
-				printf(format, '@');
+				fprintf(out, format, '@');
 			}
 			if (grid == E_WHITE)
 			{
-				printf(format, 'O');
+				fprintf(out, format, 'O');
 			}
 		}
-		cout << endl;
+		fprintf(out, "\n");
 	}
-	cout << endl;
+	fprintf(out, "\n");
 }
 
-void Board::PrintScore(int side, bool isLog)
+void Board::PrintScore(int side, FILE *fp)
 {
+	FILE *out = (fp != NULL) ? fp : stdout;
+
 	int i0 = (side == Board::E_BLACK) ? 0 : 1;
 
-	cout << "  ";
+	fprintf(out, "  ");
 	for (int i = 0; i < BOARD_SIZE; ++i)
 	{
-		printf("    %c", 'A' + i);
+		fprintf(out, "    %c", 'A' + i);
 	}
-	cout << endl << endl;
+	fprintf(out, "\n\n");
 
 	for (int i = 0; i < BOARD_SIZE; ++i)
 	{
 		if (i < 9)
-			printf("%d ", i + 1);
+			fprintf(out, "%d ", i + 1);
 		else
-			printf("%c ", 'a' + i - 9);
+			fprintf(out, "%c ", 'a' + i - 9);
 
 		for (int j = 0; j < BOARD_SIZE; ++j)
 		{
@@ -211,36 +297,39 @@ void Board::PrintScore(int side, bool isLog)
 			if (grids[id] == E_EMPTY)
 			{
 				if (score != 0)
-					printf("%5d", score);
+					fprintf(out, "%5d", score);
 				else
-					printf("     ");
+					fprintf(out, "     ");
 			}
 			else
 			{
-				printf("%5d", -grids[id]);
+				fprintf(out, "%5d", -grids[id]);
 			}
 		}
-		cout << endl << endl;
+		fprintf(out, "\n\n");
 	}
 }
 
-void Board::PrintPriority(bool isLog)
+void Board::PrintPriority(FILE *fp)
 {
+	bool isLog = (fp != NULL); // log to file, otherwise print to console
+	FILE *out = isLog ? fp : stdout;
+
 	const char *format = (isLog ? "%c  " : "%c ");
 
-	cout << (isLog ? "   " : "  ");
+	fprintf(out, isLog ? "   " : "  ");
 	for (int i = 0; i < BOARD_SIZE; ++i)
 	{
-		printf(format, 'A' + i);
+		fprintf(out, format, 'A' + i);
 	}
-	cout << endl;
+	fprintf(out, "\n");
 
 	for (int i = 0; i < BOARD_SIZE; ++i)
 	{
 		if (i < 9)
-			printf(format, '1' + i);
+			fprintf(out, format, '1' + i);
 		else
-			printf(format, 'a' + i - 9);
+			fprintf(out, format, 'a' + i - 9);
 
 		for (int j = 0; j < BOARD_SIZE; ++j)
 		{
@@ -249,28 +338,28 @@ void Board::PrintPriority(bool isLog)
 
 			if (grid == E_EMPTY)
 			{
-				int priority = gridCheckStatus[id];
+				int priority = GetGridPriority(id);
 				if (priority < E_LOWEST)
 				{
-					printf((isLog ? "%d  " : "%d "), priority);
+					fprintf(out, (isLog ? "%d  " : "%d "), priority);
 				}
 				else
 				{
-					printf(format, ' ');
+					fprintf(out, format, ' ');
 				}
 			}
 			if (grid == E_BLACK)
 			{
-				printf(format, '+');
+				fprintf(out, format, '+');
 			}
 			if (grid == E_WHITE)
 			{
-				printf(format, '-');
+				fprintf(out, format, '-');
 			}
 		}
-		cout << endl;
+		fprintf(out, "\n");
 	}
-	cout << endl;
+	fprintf(out, "\n");
 }
 
 char Board::GetGrid(int row, int col)
@@ -344,7 +433,7 @@ void Board::InitLineScoreDict()
 
 	if (OUTPUT_RESTRICTED_SCORE)
 	{
-		fopen_s(&fp, "restricted_score.log", "w");
+		fp = fopen("restricted_score.log", "w");
 		for (int i = 0; i < 10000; ++i)
 		{
 			if (Board::IsRestrictedMove(i))
@@ -355,14 +444,71 @@ void Board::InitLineScoreDict()
 		fclose(fp);
 	}
 
+#if COMPACT_LINE_TABLE
+	// index of 4 grids on one side, given from the middle outward
+	// the first n grids are on board and the others are not, base 3 digits of grids on board follow patterns of smaller n
+	auto calcHalfIndex = [](const array<int, 4> &grids) -> int
+	{
+		int n = 0;
+		while (n < 4 && grids[n] != E_INVALID)
+			++n;
+
+		int index = 0, weight = 1;
+		for (int i = 0; i < n; ++i)
+		{
+			index += weight;
+			weight *= 3;
+		}
+
+		weight = 1;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (i >= n)
+			{
+				if (grids[i] != E_INVALID)
+					return -1; // grid on board after one off board, never happens
+				continue;
+			}
+
+			index += grids[i] * weight;
+			weight *= 3;
+		}
+		return index;
+	};
+
+	for (int i = 0; i < 256; ++i)
+	{
+		array<int, 4> grids;
+		for (int j = 0; j < 4; ++j)
+			grids[j] = (i >> ((3 - j) * 2)) & 3; // grid 3 of the key is next to the middle
+
+		int index = calcHalfIndex(grids);
+		lineLeftIndex[i] = (index < 0) ? 0 : index * LINE_HALF_NUM;
+	}
+
+	for (int i = 0; i < 1024; ++i)
+	{
+		array<int, 4> grids;
+		for (int j = 0; j < 4; ++j)
+			grids[j] = (i >> ((j + 1) * 2)) & 3;
+
+		int middle = i & 3;
+		int index = calcHalfIndex(grids);
+		if (index < 0 || middle == E_EMPTY || middle == E_INVALID)
+			lineRightIndex[i] = 0;
+		else
+			lineRightIndex[i] = (middle - 1) * LINE_HALF_NUM * LINE_HALF_NUM + index;
+	}
+
+	linePatternScore.fill(0);
+#endif
+
 	char strmap[4] = { ' ', '@', 'O', 'X' };
 
 	if (OUTPUT_LINE_SCORE_DICT)
-		fopen_s(&fp, "line_dict.log", "w");
-
-	int maxId = pow(4, 9);
+		fp = fopen("line_dict.log", "w");
 
-	for (int i = 0; i < maxId; ++i)
+	for (int i = 0; i < LINE_ID_MAX; ++i)
 	{
 		array<char, 9> line;
 		char lineStr[12];
@@ -413,7 +559,11 @@ void Board::InitLineScoreDict()
 		if (isValid)
 		{
 			short score = CalcLineScore(line);
+#if COMPACT_LINE_TABLE
+			linePatternScore[lineLeftIndex[i & 0xff] + lineRightIndex[i >> 8]] = score;
+#else
 			lineScoreDict[i] = score;
+#endif
 
 			if (OUTPUT_LINE_SCORE_DICT && score > 0)
 			{
@@ -425,7 +575,6 @@ void Board::InitLineScoreDict()
 	if (OUTPUT_LINE_SCORE_DICT)
 		fclose(fp);
 
-	isLineScoreDictReady = true;
 }
 
 short Board::CalcLineScore(array<char, 9> line)
@@ -634,37 +783,44 @@ short Board::CalcLineScore(array<char, 9> line)
 
 void Board::UpdatScoreInfo(int id, int turn)
 {
-	int row0, col0;
-	Board::Id2Coord(id, row0, col0);
-
-	int side = GetGrid(row0, col0);
+	int side = grids[id];
 	int otherSide = 3 - side;
 
 	int i0 = (side == E_BLACK) ? 0 : 1; // this side
 	int i1 = 1 - i0; // other side
 
-	UpdateKeyInfo(row0, col0);
+	UpdateLineBits(id, i0);
+
+	hashKey ^= zobristKey[i0][id];
+
+	array<uint8_t, 32> changedGrids;
+	int changedCount = 0;
 
 	for (int j = 0 ; j < 8; ++j)
 	{
-		int dx, dy;
-		Board::Direction2DxDy((ChessDirection)j, dx, dy);
+		int keyGroup = (j < 4) ? j : 7 - j;
+		int keyStep = (j < 4) ? 1 : -1;
+		int key = GetLineKey(id, keyGroup);
 
 		bool needUpdate0 = true, needUpdate1 = true;
-		int row = row0, col = col0;
 		for (int k = 1; k <= 4; ++k)
 		{
-			row += dy; col += dx;
-
-			int chess = GetGrid(row, col);
+			int shift = 4 + k * keyStep;
+			int chess = (key >> (shift * 2)) & 3;
 
 			if (chess == E_EMPTY)
 			{
+				int id1 = id + k * keyStep * KEY_GROUP_STEP[keyGroup];
+				int key1 = GetLineKey(id1, keyGroup);
+				int keyX = side << ((8 - shift) * 2); // this chess in the key of grid id1
+
 				if (needUpdate0)
-					UpdateScore(row, col, row0, col0, (ChessDirection)j, side);
+					UpdateScore(id1, key1, keyX, side);
 
 				if (needUpdate1)
-					UpdateScore(row, col, row0, col0, (ChessDirection)j, otherSide);
+					UpdateScore(id1, key1, keyX, otherSide);
+
+				changedGrids[changedCount++] = id1;
 			}
 			else if (chess == side)
 			{
@@ -680,390 +836,311 @@ void Board::UpdatScoreInfo(int id, int turn)
 		}
 	}
 
-	keyInfo[0] = keyInfo[1];
+	UpdateGridType(id);
+	for (int i = 0; i < changedCount; ++i)
+		UpdateGridType(changedGrids[i]);
 
 	UpdateGridsInfo(i1); // grids info for next turn
 }
 
-void Board::InitKeyInfo()
+void Board::InitZobristKey()
 {
-	if (!isKeyInfoOriginReady)
-	{
-		for (int i = 0; i < 4; ++i)
-		{
-			Board::keyInfoOrigin[i].fill(0);
-		}
+	// fixed seed, so hash keys are the same in every run
+	uint64_t seed = 0x9E3779B97F4A7C15ull;
 
-		for (int i = 0; i < GRID_NUM; ++i)
+	for (int i = 0; i < 2; ++i)
+	{
+		for (int j = 0; j < GRID_NUM; ++j)
 		{
-			int row, col;
-			Board::Id2Coord(i, row, col);
-
-			for (int j = 0; j < 4; ++j)
-			{
-				int key = 0;
-
-				int dx, dy;
-				Board::Direction2DxDy((ChessDirection)j, dx, dy);
-
-				int row1 = row, col1 = col;
-				for (int k = 1; k <= 4; ++k)
-				{
-					row1 += dy; col1 += dx;
-
-					int shift = 4 + k;
-					int value = GetGrid(row1, col1) << (shift * 2);
-					key += value;
-				}
-
-				row1 = row; col1 = col;
-				for (int k = 1; k <= 4; ++k)
-				{
-					row1 -= dy; col1 -= dx;
-
-					int shift = 4 - k;
-					int value = GetGrid(row1, col1) << (shift * 2);
-					key += value;
-				}
-				Board::keyInfoOrigin[j][i] = key;
-			}
+			// splitmix64
+			uint64_t key = (seed += 0x9E3779B97F4A7C15ull);
+			key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ull;
+			key = (key ^ (key >> 27)) * 0x94D049BB133111EBull;
+			zobristKey[i][j] = key ^ (key >> 31);
 		}
-		isKeyInfoOriginReady = true;
 	}
-	keyInfo[0] = Board::keyInfoOrigin;
-	keyInfo[1] = Board::keyInfoOrigin;
 }
 
-__declspec(noinline)
-void Board::UpdateKeyInfo(int row, int col)
+void Board::InitLineBits()
 {
-	int side = GetGrid(row, col);
-
-	for (int j = 0; j < 8; ++j)
+	for (int i = 0; i < GRID_NUM; ++i)
 	{
-		int keyGroup = (j < 4) ? j : 7 - j;
-		keyInfo[1][keyGroup][Board::Coord2Id(row, col)] += side << (4 * 2);
+		int row, col;
+		Board::Id2Coord(i, row, col);
 
-		int dx, dy;
-		Board::Direction2DxDy((ChessDirection)j, dx, dy);
+		lineIndex[0][i] = row; linePos[0][i] = col;
+		lineIndex[1][i] = col; linePos[1][i] = row;
+		lineIndex[2][i] = col - row + BOARD_SIZE - 1; linePos[2][i] = row;
+		lineIndex[3][i] = row + col; linePos[3][i] = row;
+	}
 
-		int row1 = row, col1 = col;
-		for (int k = 1; k <= 4; ++k)
-		{
-			row1 += dy; col1 += dx;
+	// every grid is off board until it is found on a line
+	for (int i = 0; i < 4; ++i)
+		lineBitsOrigin[i].fill((1 << (BOARD_SIZE + 8)) - 1);
 
-			if (Board::IsValidCoord(row1, col1))
-			{
-				int shift = (j < 4) ? (4 - k) : (4 + k);
-				int value = side << (shift * 2);
-				keyInfo[1][keyGroup][Board::Coord2Id(row1, col1)] += value;
-			}
+	for (int i = 0; i < GRID_NUM; ++i)
+	{
+		for (int j = 0; j < 4; ++j)
+			lineBitsOrigin[j][lineIndex[j][i]] &= ~(1 << (linePos[j][i] + 4));
+	}
+
+	// bit b of a 9 grids window is the grid at slot 8 - b of a line key
+	for (int i = 0; i < 512; ++i)
+	{
+		int key = 0;
+		for (int b = 0; b < 9; ++b)
+		{
+			if (i & (1 << b))
+				key += 1 << ((8 - b) * 2);
 		}
+		lineKeySpread[i] = key;
 	}
 }
 
-void Board::UpdateScoreOpt(int row, int col, ChessDirection direction, int side)
+void Board::UpdateLineBits(int id, int i0)
 {
-	int id = Board::Coord2Id(row, col);
-	int keyGroup = (direction < 4) ? direction : 7 - direction;
-	int key = keyInfo[1][keyGroup][id] + (side << (4 * 2));
-	int key0 = keyInfo[0][keyGroup][id] + (side << (4 * 2));
-
-	int lineScore = lineScoreDict[key];
-	int lineScore0 = lineScoreDict[key0];
-
-	int i0 = (side == E_BLACK) ? 0 : 1; // this side
-	scoreInfo[i0][Board::Coord2Id(row, col)] += lineScore - lineScore0;
+	for (int j = 0; j < 4; ++j)
+		lineBits[i0][j][lineIndex[j][id]] |= 1 << (linePos[j][id] + 4);
 }
 
-__declspec(noinline)
-void Board::UpdateScore(int row, int col, int rowX, int colX, ChessDirection direction, int side)
+int Board::GetLineKey(int id, int keyGroup)
 {
-	if (ENABLE_KEY_OPTIMIZATION)
-	{
-		UpdateScoreOpt(row, col, direction, side);
-		return;
-	}
-
-	int key = side << (4 * 2);
-	int key0 = key;
+	int line = lineIndex[keyGroup][id];
+	int pos = linePos[keyGroup][id];
 
-	int dx, dy;
-	direction = ChessDirection(7 - direction);
-	Board::Direction2DxDy(direction, dx, dy);
+	int black = (lineBits[0][keyGroup][line] >> pos) & 0x1ff;
+	int white = (lineBits[1][keyGroup][line] >> pos) & 0x1ff;
 
-	int row1 = row, col1 = col;
-	for (int i = 1; i <= 4; ++i)
-	{
-		row1 -= dy; col1 -= dx;
-
-		int value = GetGrid(row1, col1) << ((4 - i) * 2);
-		key += value;
-
-		if (!(row1 == rowX && col1 == colX))
-			key0 += value;
-	}
-
-	row1 = row, col1 = col;
-	for (int i = 1; i <= 4; ++i)
-	{
-		row1 += dy; col1 += dx;
-
-		int value = GetGrid(row1, col1) << ((4 + i) * 2);
-		key += value;
-
-		if (!(row1 == rowX && col1 == colX))
-			key0 += value;
-	}
+	return lineKeySpread[black] + lineKeySpread[white] * 2; // off board grids become E_INVALID
+}
 
-	int lineScore0 = lineScoreDict[key0];
-	int lineScore = lineScoreDict[key];
+NOINLINE
+void Board::UpdateScore(int id, int key, int keyX, int side)
+{
+	key += side << (4 * 2);
 
-	/*int id = Board::Coord2Id(row, col);
-	int keyGroup = (direction < 4) ? direction : 7 - direction;
-	int key2 = keyInfo[1][keyGroup][id] + (side << (4 * 2));
-	int key02 = keyInfo[0][keyGroup][id] + (side << (4 * 2));
-	assert(key2 == key || key02 == key0);*/
+	int lineScore = GetLineScore(key);
+	int lineScore0 = GetLineScore(key - keyX);
 
 	int i0 = (side == E_BLACK) ? 0 : 1; // this side
-	scoreInfo[i0][Board::Coord2Id(row, col)] += lineScore - lineScore0;
+	scoreInfo[i0][id] += lineScore - lineScore0;
 }
 
-void Board::FindOtherGrids(int i0, int id, GridType type)
+void Board::FindOtherGrids(int i0, int id, GridSet &result)
 {
 	int side = (i0 == 0) ? E_BLACK : E_WHITE;
 	int otherSide = 3 - side;
 
-	int row, col;
-	Board::Id2Coord(id, row, col);
-
 	for (int d = 0; d < 4; ++d)
 	{
-		int dx, dy;
-		Board::Direction2DxDy((Board::ChessDirection)d, dx, dy);
-
 		// calc origin key & line score
-		int key = side << ( 4 * 2);
-		int row1 = row, col1 = col;
-		for (int i = 0; i < 4; ++i)
-		{
-			row1 -= dy; col1 -= dx;
+		int key = GetLineKey(id, d) + (side << (4 * 2));
+		int lineScore = GetLineScore(key);
 
-			int value = GetGrid(row1, col1) << ((3 - i) * 2);
-			key += value;
-		}
-
-		row1 = row, col1 = col;
-		for (int i = 0; i < 4; ++i)
+		// check valid grids on both sides
+		for (int keyStep = -1; keyStep <= 1; keyStep += 2)
 		{
-			row1 += dy; col1 += dx;
-
-			int value = GetGrid(row1, col1) << ((5 + i) * 2);
-			key += value;
-		}
-		int lineScore = lineScoreDict[key];
-
-		// check valid grids
-		row1 = row, col1 = col;
-		for (int i = 0; i < 4; ++i)
-		{
-			row1 -= dy; col1 -= dx;
-
-			int chess = GetGrid(row1, col1);
-
-			if (chess == E_INVALID || chess == otherSide)
-				break;
-
-			if (chess == E_EMPTY)
+			for (int i = 1; i <= 4; ++i)
 			{
-				int value = otherSide << ((3 - i) * 2);
-				int key1 = key + value;
-				int lineScore1 = lineScoreDict[key1];
-				int newScore = scoreInfo[i0][id] + lineScore1 - lineScore;
+				int shift = 4 + i * keyStep;
+				int chess = (key >> (shift * 2)) & 3;
 
-				if (newScore < THREE_THREE_SCORE)
+				if (chess == E_INVALID || chess == otherSide)
+					break;
+
+				if (chess == E_EMPTY)
 				{
-					int id1 = Board::Coord2Id(row1, col1);
-					gridCheckStatus[id1] = min(gridCheckStatus[id1], type);
+					int key1 = key + (otherSide << (shift * 2));
+					int lineScore1 = GetLineScore(key1);
+					int newScore = scoreInfo[i0][id] + lineScore1 - lineScore;
+
+					if (newScore < THREE_THREE_SCORE)
+					{
+						result.Set(id + i * keyStep * KEY_GROUP_STEP[d]);
+					}
 				}
 			}
 		}
+	}
+}
 
-		row1 = row, col1 = col;
-		for (int i = 0; i < 4; ++i)
-		{
-			row1 += dy; col1 += dx;
+void Board::UpdateGridType(int id)
+{
+	for (int i0 = 0; i0 < 2; ++i0)
+	{
+		bool isFixed = false;
+		int type = (grids[id] == E_EMPTY) ? CalcGridType(i0, id, isFixed) : E_GRID_TYPE_MAX;
+		int oldType = gridType[i0][id];
 
-			int chess = GetGrid(row1, col1);
+		if (isFixed)
+			fixedGrids[i0].Set(id);
+		else
+			fixedGrids[i0].Reset(id);
 
-			if (chess == E_INVALID || chess == otherSide)
-				break;
+		if (type != oldType)
+		{
+			if (oldType != E_GRID_TYPE_MAX)
+				gridTypeSet[i0][oldType - E_RESTRICTED].Reset(id);
 
-			if (chess == E_EMPTY)
-			{
-				int value = otherSide << ((5 + i) * 2);
-				int key1 = key + value;
-				int lineScore1 = lineScoreDict[key1];
-				int newScore = scoreInfo[i0][id] + lineScore1 - lineScore;
+			if (type != E_GRID_TYPE_MAX)
+				gridTypeSet[i0][type - E_RESTRICTED].Set(id);
 
-				if (newScore < THREE_THREE_SCORE)
-				{
-					int id1 = Board::Coord2Id(row1, col1);
-					gridCheckStatus[id1] = min(gridCheckStatus[id1], type);
-				}
-			}
+			gridType[i0][id] = type;
 		}
 	}
 }
 
-__declspec(noinline)
-void Board::UpdateGridsInfo(int i0)
+int Board::CalcGridType(int i0, int id, bool &isFixed)
 {
 	int i1 = 1 - i0;
 
-	gridCheckStatus.fill(E_GRID_TYPE_MAX);
-	hasGridType.fill(false);
+	int score0 = scoreInfo[i0][id];
+	int score1 = scoreInfo[i1][id];
 
-	for (int i = 0; i < GRID_NUM; ++i)
+	if (Board::RestrictedMoveRule)
 	{
-		if (grids[i] != E_EMPTY)
-			continue;
-
-		int score0 = scoreInfo[i0][i];
-		int score1 = scoreInfo[i1][i];
-
-		if (Board::RestrictedMoveRule)
+		if (i1 == 0 && score1 >= THREE_THREE_SCORE && IsRestrictedMove(score1))
 		{
-			if (i1 == 0 && score1 >= THREE_THREE_SCORE && IsRestrictedMove(score1))
-			{
-				score1 = 0;
-
-				if (score0 < THREE_THREE_SCORE) // leave opponent's restricted move untouched if not neccessary
-				{
-					gridCheckStatus[i] = E_OTHER;
-					continue;
-				}
-			}
+			score1 = 0;
 
-			if (i0 == 0 && score0 >= THREE_THREE_SCORE && IsRestrictedMove(score0))
+			if (score0 < THREE_THREE_SCORE) // leave opponent's restricted move untouched if not neccessary
 			{
-				gridCheckStatus[i] = E_RESTRICTED;
-				continue;
+				isFixed = true;
+				return E_OTHER;
 			}
 		}
 
-		if (score0 >= THREE_THREE_SCORE || score1 >= THREE_THREE_SCORE)
+		if (i0 == 0 && score0 >= THREE_THREE_SCORE && IsRestrictedMove(score0))
 		{
-			if (score0 >= FIVE_SCORE)
-			{
-				gridCheckStatus[i] = E_FIVE;
-				hasGridType[E_FIVE] = true;
-			}
-			else if (score1 >= FIVE_SCORE)
-			{
-				gridCheckStatus[i] = E_COUNTER_FIVE;
-				hasGridType[E_COUNTER_FIVE] = true;
-			}
-			else if (score0 >= OPEN_FOUR_SCORE)
-			{
-				gridCheckStatus[i] = E_OPEN_FOUR;
-				hasGridType[E_OPEN_FOUR] = true;
-			}
-			else if (score0 >= FOUR_THREE_SCORE)
-			{
-				gridCheckStatus[i] = E_FOUR_THREE;
-				hasGridType[E_FOUR_THREE] = true;
-			}
-			else if (score0 >= CLOSE_FOUR_SCORE)
-			{
-				gridCheckStatus[i] = E_CLOSE_FOUR;
-				hasGridType[E_CLOSE_FOUR] = true;
-			}
-			else if (score1 >= OPEN_FOUR_SCORE)
-			{
-				gridCheckStatus[i] = E_COUNTER_OPEN_FOUR;
-				hasGridType[E_COUNTER_OPEN_FOUR] = true;
-
-				FindOtherGrids(i1, i, E_COUNTER_OPEN_FOUR); // find other possible counter moves
-			}
-			else if (score1 >= FOUR_THREE_SCORE)
-			{
-				gridCheckStatus[i] = E_COUNTER_FOUR_THREE;
-				hasGridType[E_COUNTER_FOUR_THREE] = true;
-
-				FindOtherGrids(i1, i, E_COUNTER_FOUR_THREE); // find other possible counter moves
-			}
-			else if (score0 >= THREE_THREE_SCORE)
-			{
-				gridCheckStatus[i] = E_THREE_THREE;
-				hasGridType[E_THREE_THREE] = true;
-			}
-			else //if (score1 >= THREE_THREE_SCORE)
-			{
-				gridCheckStatus[i] = E_COUNTER_THREE_THREE;
-				hasGridType[E_COUNTER_THREE_THREE] = true;
+			isFixed = true;
+			return E_RESTRICTED;
+		}
+	}
 
-				FindOtherGrids(i1, i, E_COUNTER_THREE_THREE); // find other possible counter moves
-			}
+	if (score0 >= THREE_THREE_SCORE || score1 >= THREE_THREE_SCORE)
+	{
+		isFixed = true;
+
+		if (score0 >= FIVE_SCORE)
+			return E_FIVE;
+		else if (score1 >= FIVE_SCORE)
+			return E_COUNTER_FIVE;
+		else if (score0 >= OPEN_FOUR_SCORE)
+			return E_OPEN_FOUR;
+		else if (score0 >= FOUR_THREE_SCORE)
+			return E_FOUR_THREE;
+		else if (score0 >= CLOSE_FOUR_SCORE)
+			return E_CLOSE_FOUR;
+		else if (score1 >= OPEN_FOUR_SCORE)
+			return E_COUNTER_OPEN_FOUR;
+		else if (score1 >= FOUR_THREE_SCORE)
+			return E_COUNTER_FOUR_THREE;
+		else if (score0 >= THREE_THREE_SCORE)
+			return E_THREE_THREE;
+		else //if (score1 >= THREE_THREE_SCORE)
+			return E_COUNTER_THREE_THREE;
+	}
+	else
+	{
+		if (score0 >= TWO_TWO_SCORE || score1 >= TWO_TWO_SCORE)
+		{
+			if (score0 >= OPEN_THREE_SCORE)
+				return E_OPEN_THREE;
+			else if (score1 >= OPEN_THREE_SCORE)
+				return E_COUNTER_OPEN_THREE;
+			else //if (score0 >= TWO_TWO_SCORE || score1 >= TWO_TWO_SCORE)
+				return E_TWO_TWO;
 		}
 		else
 		{
-			if (score0 >= TWO_TWO_SCORE || score1 >= TWO_TWO_SCORE)
-			{
-				if (score0 >= OPEN_THREE_SCORE)
-				{
-					gridCheckStatus[i] = min(gridCheckStatus[i], E_OPEN_THREE);
-				}
-				else if (score1 >= OPEN_THREE_SCORE)
-				{
-					gridCheckStatus[i] = min(gridCheckStatus[i], E_COUNTER_OPEN_THREE);
-				}
-				else //if (score0 >= TWO_TWO_SCORE || score1 >= TWO_TWO_SCORE)
-				{
-					gridCheckStatus[i] = min(gridCheckStatus[i], E_TWO_TWO);
-				}
-			}
+			if (score0 > 0)
+				return E_OPEN_TWO;
 			else
-			{
-				if (score0 > 0)
-				{
-					gridCheckStatus[i] = min(gridCheckStatus[i], E_OPEN_TWO);
-				}
-				else
-				{
-					gridCheckStatus[i] = min(gridCheckStatus[i], E_OTHER);
-				}
-			}
+				return E_OTHER;
 		}
 	}
+}
+
+NOINLINE
+void Board::UpdateGridsInfo(int i0)
+{
+	int i1 = 1 - i0;
+
+	array<GridSet, E_GRID_TYPE_MAX - E_RESTRICTED> typeSet = gridTypeSet[i0];
+	auto GetTypeSet = [&typeSet](int type) -> GridSet& { return typeSet[type - E_RESTRICTED]; };
 
 	int bestType = E_GRID_TYPE_MAX;
-	for (int i = 0; i < E_GRID_TYPE_MAX; ++i)
+	for (int i = E_FIVE; i <= E_COUNTER_THREE_THREE; ++i)
 	{
-		if (hasGridType[i])
+		if (GetTypeSet(i).Any())
 		{
 			bestType = i;
 			break;
 		}
 	}
 
+	// find other possible counter moves, they are moved to the counter type if it is better than their own type
+	// a fixed grid keeps its own type if it comes after the counter move, same as scanning the board in order
+	const GridType counterTypes[] = { E_COUNTER_OPEN_FOUR, E_COUNTER_FOUR_THREE, E_COUNTER_THREE_THREE };
+	GridSet otherGrids[3];
+
+	for (int i = 0; i < 3; ++i)
+	{
+		GetTypeSet(counterTypes[i]).ForEach([&](int id)
+		{
+			GridSet grids;
+			FindOtherGrids(i1, id, grids);
+
+			grids.ForEach([&](int id1)
+			{
+				if (id1 < id || !fixedGrids[i0].Test(id1))
+					otherGrids[i].Set(id1);
+			});
+		});
+	}
+
+	GridSet movedGrids;
+	for (int i = 0; i < 3; ++i)
+	{
+		int type = counterTypes[i];
+		GridSet grids = otherGrids[i] & ~movedGrids;
+
+		grids.ForEach([&](int id)
+		{
+			int oldType = gridType[i0][id];
+			if (type < oldType)
+			{
+				GetTypeSet(oldType).Reset(id);
+				GetTypeSet(type).Set(id);
+			}
+		});
+		movedGrids |= otherGrids[i];
+	}
+
 	keyGrid = 0xff;
 	hasPriority.fill(false);
 
-	for (int i = 0; i < GRID_NUM; ++i)
+	for (auto &gridSet : prioritySet)
+		gridSet.Clear();
+
+	for (int type = E_RESTRICTED; type < E_GRID_TYPE_MAX; ++type)
 	{
+		const GridSet &grids = GetTypeSet(type);
+		if (!grids.Any())
+			continue;
+
 		int priority = E_PRIORITY_MAX;
 
-		switch (gridCheckStatus[i])
+		switch (type)
 		{
 		case E_FIVE:
 		case E_COUNTER_FIVE:
 		case E_OPEN_FOUR:
 		case E_FOUR_THREE:
-			if (bestType == gridCheckStatus[i])
+			if (bestType == type)
 			{
 				priority = E_HIGHEST;
-				keyGrid = i;
+				keyGrid = grids.Last();
 			}
 			else
 			{
@@ -1097,12 +1174,12 @@ void Board::UpdateGridsInfo(int i0)
 			break;
 		}
 
-		gridCheckStatus[i] = priority;
+		prioritySet[priority] |= grids;
 		hasPriority[priority] = true;
 	}
 }
 
-__declspec(noinline)
+NOINLINE
 bool Board::IsRestrictedMove(int score)
 {
 	if (score >= RESTRICTED_SCORE)
@@ -1132,14 +1209,17 @@ bool Board::IsRestrictedMove(int score)
 
 void Board::GetGridsByPriority(ChessPriority priority, array<uint8_t, GRID_NUM> &result, int &count)
 {
-	count = 0;
-	for (int i = 0; i < GRID_NUM; ++i)
+	count = prioritySet[priority].ToArray(result);
+}
+
+int Board::GetGridPriority(int id)
+{
+	for (int i = 0; i < E_PRIORITY_MAX; ++i)
 	{
-		if (gridCheckStatus[i] == priority)
-		{
-			result[count++] = i;
-		}
+		if (prioritySet[i].Test(id))
+			return i;
 	}
+	return E_PRIORITY_MAX;
 }
 
 int Board::Coord2Id(int row, int col)
@@ -1203,6 +1283,35 @@ int Board::CalcDistance(int id1, int id2)
 }
 ///////////////////////////////////////////////////////////////////////
 
+void Random::Seed(uint64_t seed)
+{
+	// splitmix64, fills the state with well mixed bits even for small seeds
+	for (int i = 0; i < 4; ++i)
+	{
+		uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		s[i] = z ^ (z >> 31);
+	}
+}
+
+uint64_t Random::Next()
+{
+	uint64_t result = s[1] * 5;
+	result = ((result << 7) | (result >> 57)) * 9;
+
+	uint64_t t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 45) | (s[3] >> 19);
+
+	return result;
+}
+///////////////////////////////////////////////////////////////////////
+
 GameBase::GameBase()
 {
 	Init();
@@ -1285,9 +1394,9 @@ int GameBase::GetSide()
 	return (turn % 2 == 1) ? Board::E_BLACK : Board::E_WHITE;
 }
 
-int GameBase::GetNextMove()
+int GameBase::GetNextMove(Random &random)
 {
-	int id = rand() % validGridCount;
+	int id = random.Next(validGridCount);
 	return validGrids[id];
 }
 
@@ -1303,9 +1412,7 @@ int GameBase::CalcBetterSide()
 
 Game::Game()
 {
-	// clear log file
-	fopen_s(&fp, GAME_LOG_FILE, "w");
-	fclose(fp);
+	logLevel = E_LOG_MOVE;
 }
 
 bool Game::PutChess(int Id)
@@ -1360,13 +1467,30 @@ void Game::Print()
 
 void Game::OutputLog()
 {
-	freopen_s(&fp, GAME_LOG_FILE, "a+", stdout);
-	board.Print(lastMove, true);
-	board.PrintScore(3 - GetSide(), true);
-	board.PrintScore(GetSide(), true);
-	board.PrintPriority(true);
-	fclose(stdout);
-	freopen_s(&fp, "CON", "w", stdout);
+	if (logLevel == E_LOG_NONE)
+		return;
+
+	// formatted by the log thread, the game is copied if the board is needed
+	LogWriter &writer = LogWriter::Get();
+
+	writer.ClearOnce(GAME_LOG_FILE); // the log is cleared by the first move written, not by every game created
+
+	if (logLevel >= E_LOG_BOARD)
+	{
+		writer.Write(GAME_LOG_FILE, [game = *((GameBase*)this)](FILE *fp) mutable
+		{
+			game.board.Print(game.lastMove, fp);
+			game.board.PrintScore(3 - game.GetSide(), fp);
+			game.board.PrintScore(game.GetSide(), fp);
+			game.board.PrintPriority(fp);
+		});
+	}
+
+	writer.Write(GAME_LOG_FILE, [turn = turn - 1, id = lastMove, state = state, hashKey = board.hashKey](FILE *fp)
+	{
+		fprintf(fp, "turn: %d, side: %s, move: %s, state: %d, hash: %016llx\n", turn, (turn % 2 == 1) ? "black" : "white",
+			Game::Id2Str(id).c_str(), state, (unsigned long long)hashKey);
+	});
 }
 
 int Game::Str2Id(const string &str)
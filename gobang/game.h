@@ -5,9 +5,28 @@
 #include <array>
 #include <list>
 #include <map>
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
 
+#ifdef _MSC_VER
+#include <intrin.h>
 #pragma warning (disable:4244)
 #pragma warning (disable:4018)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+// black is not allowed to make 3 + 3, 4 + 4 or more than 5, the build defines it for the restricted engine
+#ifndef RESTRICTED_MOVE_RULE
+#define RESTRICTED_MOVE_RULE 0
+#endif
+
+// line scores from a 60 KB pattern table instead of the 1 MB dictionary, see Board::GetLineScore
+#ifndef COMPACT_LINE_TABLE
+#define COMPACT_LINE_TABLE 0
+#endif
 
 using namespace std;
 
@@ -26,7 +45,78 @@ const int FOUR_THREE_SCORE = OPEN_THREE_SCORE + CLOSE_FOUR_SCORE; // 3 + 4, 4 +
 const int THREE_THREE_SCORE = OPEN_THREE_SCORE * 2; // 3 + 3, 3 + 4, 4 + 4
 const int TWO_TWO_SCORE = OTHER_SCORE * 2;
 
-const int LINE_ID_MAX = 262144; // 4 ^ 9
+const int LINE_ID_MAX = 262144; // 4 ^ 9, line key of 9 grids with 2 bits per grid
+const int LINE_HALF_NUM = 121; // 4 grids on one side of a line, off board grids are only at the far end: 1 + 3 + 9 + 27 + 81
+const int LINE_PATTERN_NUM = LINE_HALF_NUM * LINE_HALF_NUM * 2; // both sides and the chess in the middle
+const int LINE_NUM_MAX = BOARD_SIZE * 2 - 1; // diagonal lines in one direction
+
+// xoshiro256** generator, each search thread owns one instead of sharing the global rand() state
+class Random
+{
+public:
+	Random(uint64_t seed = 0) { Seed(seed); }
+
+	void Seed(uint64_t seed);
+	uint64_t Next();
+	int Next(int n) { return (int)(((Next() >> 32) * n) >> 32); } // in [0, n)
+
+private:
+	uint64_t s[4];
+};
+
+inline int LowestBit(uint64_t x)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+inline int HighestBit(uint64_t x)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return index;
+#else
+	return 63 - __builtin_clzll(x);
+#endif
+}
+
+// one bit per grid
+class GridSet
+{
+public:
+	GridSet() { bits.fill(0); }
+
+	void Set(int id) { bits[id >> 6] |= 1ull << (id & 63); }
+	void Reset(int id) { bits[id >> 6] &= ~(1ull << (id & 63)); }
+	bool Test(int id) const { return (bits[id >> 6] >> (id & 63)) & 1; }
+	bool Any() const { return (bits[0] | bits[1] | bits[2] | bits[3]) != 0; }
+	void Clear() { bits.fill(0); }
+	void Fill();
+
+	int Last() const;
+	int ToArray(array<uint8_t, GRID_NUM> &result) const;
+
+	GridSet& operator|=(const GridSet &other);
+	GridSet operator&(const GridSet &other) const;
+	GridSet operator~() const;
+
+	template<typename F> void ForEach(F func) const
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			for (uint64_t word = bits[i]; word != 0; word &= word - 1)
+				func(i * 64 + LowestBit(word));
+		}
+	}
+
+	array<uint64_t, 4> bits;
+};
 
 class Board
 {
@@ -84,15 +174,16 @@ public:
 	Board();
 
 	void Clear();
-	void Print(int lastChess, bool isLog = false);
+	void Print(int lastChess, FILE *fp = NULL); // print to console if no log file is given
 	void PrintNew(int lastChess);
-	void PrintScore(int side, bool isLog = false);
-	void PrintPriority(bool isLog = false);
+	void PrintScore(int side, FILE *fp = NULL);
+	void PrintPriority(FILE *fp = NULL);
 	void TestPrint();
 
 	bool IsWin(int id);
 	bool IsLose(int id);
 	void GetGridsByPriority(ChessPriority priority, array<uint8_t, GRID_NUM> &result, int &count);
+	int GetGridPriority(int id);
 	int CalcBoardScore(int side);
 
 	void UpdatScoreInfo(int id, int turn);
@@ -103,42 +194,73 @@ public:
 	static void Direction2DxDy(ChessDirection direction, int &dx, int &dy);
 	static int CalcDistance(int id1, int id2);
 
-	static int hitCount;
-	static int totalCount;
-
 	uint64_t hashKey;
 	uint8_t	keyGrid;
 	array<char, GRID_NUM> grids;
 	array<short, GRID_NUM> scoreInfo[2];
-	array<array<int, GRID_NUM>, 4> keyInfo[2];
-	array<char, GRID_NUM> gridCheckStatus;
-	array<bool, E_GRID_TYPE_MAX> hasGridType;
+	// one word per line in each key group, bit (pos + 4) is the grid at pos, grids off board are set for both sides
+	array<array<uint32_t, LINE_NUM_MAX>, 4> lineBits[2];
 	array<bool, E_PRIORITY_MAX + 1> hasPriority;
 
+	// grid types only change for grids whose score changed, they are kept for both sides to move
+	array<char, GRID_NUM> gridType[2];
+	array<GridSet, E_GRID_TYPE_MAX - E_RESTRICTED> gridTypeSet[2];
+	GridSet fixedGrids[2]; // grids whose type is not lowered by counter moves found before them
+	array<GridSet, E_PRIORITY_MAX> prioritySet;
+
 private:
 	char GetGrid(int row, int col);
 	bool SetGrid(int row, int col, char value);
 
-	void InitKeyInfo();
-	void UpdateKeyInfo(int row, int col);
-	void UpdateScore(int row, int col, int rowX, int colX, ChessDirection direction, int side);
-	void UpdateScoreOpt(int row, int col, ChessDirection direction, int side);
+	void UpdateLineBits(int id, int i0);
+	int GetLineKey(int id, int keyGroup);
+	void UpdateScore(int id, int key, int keyX, int side);
 	void UpdateGridsInfo(int i0);
-	void FindOtherGrids(int i0, int id, GridType type);
+	void UpdateGridType(int id);
+	int CalcGridType(int i0, int id, bool &isFixed);
+	void FindOtherGrids(int i0, int id, GridSet &result);
 
-	static bool RestrictedMoveRule;
+	static constexpr bool RestrictedMoveRule = (RESTRICTED_MOVE_RULE != 0);
 	static bool IsRestrictedMove(int id);
 
+	// tables below are shared by every board, they are built once by the first board and never written again
+	static void InitTables();
+	static once_flag isTablesReady;
+
 	static void InitLineScoreDict();
 	static short CalcLineScore(array<char, 9> line);
+	static int GetLineScore(int key);
 
+#if COMPACT_LINE_TABLE
+	// line keys are mapped to a compact pattern index, it takes one more dependent load than the dictionary
+	static array<uint16_t, 256> lineLeftIndex; // 4 grids on the left
+	static array<uint16_t, 1024> lineRightIndex; // middle grid and 4 grids on the right
+	static array<short, LINE_PATTERN_NUM> linePatternScore;
+#else
 	static array<int, LINE_ID_MAX> lineScoreDict;
-	static bool isLineScoreDictReady;
+#endif
+
+	static void InitLineBits();
+	static array<array<uint32_t, LINE_NUM_MAX>, 4> lineBitsOrigin;
+	static array<array<uint8_t, GRID_NUM>, 4> lineIndex;
+	static array<array<uint8_t, GRID_NUM>, 4> linePos;
+	static array<int, 512> lineKeySpread;
 
-	static array<array<int, GRID_NUM>, 4> keyInfoOrigin;
-	static bool isKeyInfoOriginReady;
+	static void InitZobristKey();
+	static array<array<uint64_t, GRID_NUM>, 2> zobristKey;
+
+	friend class Benchmark;
 };
 
+inline int Board::GetLineScore(int key)
+{
+#if COMPACT_LINE_TABLE
+	return linePatternScore[lineLeftIndex[key & 0xff] + lineRightIndex[key >> 8]];
+#else
+	return lineScoreDict[key];
+#endif
+}
+
 class GameBase
 {
 public:
@@ -157,7 +279,7 @@ public:
 	bool IsLonelyGrid(int id, int radius);
 	void UpdateValidGrids();
 	bool UpdateValidGridsExtra();
-	int GetNextMove();
+	int GetNextMove(Random &random);
 	int CalcBetterSide();
 
 	Board board;
@@ -171,6 +293,13 @@ public:
 class Game : private GameBase
 {
 public:
+	enum LogLevel
+	{
+		E_LOG_NONE,
+		E_LOG_MOVE, // one line for each move
+		E_LOG_BOARD, // board, scores and priorities after each move as well
+	};
+
 	Game();
 
 	int GetState() { return state; }
@@ -180,6 +309,7 @@ public:
 	void Regret(int step = 2);
 	void Reset();
 	void Print();
+	void SetLogLevel(int level) { logLevel = level; }
 
 	const vector<uint8_t>& GetRecord() { return record; }
 	static int Str2Id(const string &str);
@@ -189,7 +319,7 @@ private:
 	void RebuildBoard();
 	void OutputLog();
 
-	FILE *fp;
+	int logLevel;
 	vector<uint8_t> record;
 };
 
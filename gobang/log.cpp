@@ -0,0 +1,117 @@
+#include "log.h"
+
+LogWriter& LogWriter::Get()
+{
+	static LogWriter writer;
+	return writer;
+}
+
+LogWriter::LogWriter()
+{
+	isBusy = false;
+	stop = false;
+	worker = thread(&LogWriter::WorkerThread, this);
+}
+
+LogWriter::~LogWriter()
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		stop = true;
+	}
+	hasJob.notify_one();
+	worker.join();
+
+	for (auto &item : files)
+		fclose(item.second);
+}
+
+void LogWriter::Clear(const string &file)
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		jobs.push_back({ file, true, nullptr });
+	}
+	hasJob.notify_one();
+}
+
+void LogWriter::ClearOnce(const string &file)
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		if (!clearedFiles.insert(file).second)
+			return;
+
+		jobs.push_back({ file, true, nullptr });
+	}
+	hasJob.notify_one();
+}
+
+void LogWriter::Write(const string &file, function<void(FILE *fp)> job)
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		jobs.push_back({ file, false, move(job) });
+	}
+	hasJob.notify_one();
+}
+
+void LogWriter::Flush()
+{
+	unique_lock<mutex> lock(mtx);
+	isIdle.wait(lock, [this] { return jobs.empty() && !isBusy; });
+}
+
+FILE* LogWriter::GetFile(const string &file, bool clear)
+{
+	auto it = files.find(file);
+	if (it != files.end())
+	{
+		if (!clear)
+			return it->second;
+
+		fclose(it->second);
+		files.erase(it);
+	}
+
+	FILE *fp = fopen(file.c_str(), clear ? "wb" : "ab");
+	if (fp != NULL)
+		files[file] = fp;
+
+	return fp;
+}
+
+void LogWriter::WorkerThread()
+{
+	unique_lock<mutex> lock(mtx);
+
+	while (true)
+	{
+		if (jobs.empty())
+		{
+			// write everything out before sleeping, so logs are complete whenever the writer is idle
+			for (auto &item : files)
+				fflush(item.second);
+
+			isBusy = false;
+			isIdle.notify_all();
+
+			if (stop)
+				break;
+
+			hasJob.wait(lock, [this] { return !jobs.empty() || stop; });
+			continue;
+		}
+
+		Job job = move(jobs.front());
+		jobs.pop_front();
+		isBusy = true;
+		lock.unlock();
+
+		FILE *fp = GetFile(job.file, job.clear);
+		if (fp != NULL && job.write)
+			job.write(fp);
+
+		lock.lock();
+	}
+}
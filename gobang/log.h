@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include <deque>
+#include <map>
+#include <set>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+// writes log files on a background thread, so search and game never wait for formatting or file io
+// jobs run in the order they are posted, files stay open and are flushed when there is nothing left to write
+class LogWriter
+{
+public:
+	static LogWriter& Get();
+
+	void Clear(const string &file);
+	void ClearOnce(const string &file); // only the first call for a file in this process clears it, files are shared by all engines and games
+	void Write(const string &file, function<void(FILE *fp)> job);
+	void Flush(); // wait until all posted jobs are done
+
+private:
+	LogWriter();
+	~LogWriter();
+
+	void WorkerThread();
+	FILE* GetFile(const string &file, bool clear);
+
+	struct Job
+	{
+		string file;
+		bool clear;
+		function<void(FILE *fp)> write;
+	};
+
+	deque<Job> jobs;
+	map<string, FILE*> files;
+	set<string> clearedFiles; // by ClearOnce
+	mutex mtx;
+	condition_variable hasJob;
+	condition_variable isIdle;
+	bool isBusy;
+	bool stop;
+	thread worker;
+};
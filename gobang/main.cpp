@@ -109,6 +109,10 @@ int main()
 			break;
 		}
 
+		// ponder on human's time, not when two engines share the cpu
+		ai1.SetPonder(useAI && AIFirst && !AISecond);
+		ai2.SetPonder(useAI && AISecond && !AIFirst);
+
 		g.Print();
 		while (g.GetState() == GameBase::E_NORMAL)
 		{
@@ -140,6 +144,8 @@ int main()
 
 			g.Print();
 		}
+		ai1.StopPonder();
+		ai2.StopPonder();
 		g.Reset();
 	}
 
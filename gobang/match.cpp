@@ -0,0 +1,525 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "game.h"
+#include "mcts.h"
+
+// plays engine 1 against engine 2 with many games at once and reports Elo of engine 1 and an SPRT verdict
+// every opening is played twice with colors swapped, openings are random stones near the center which the side to move can not win at once
+// an engine is MCTS in this process, or another build speaking the Gomocup protocol, like gobang_pbrain, given by --engine path
+
+const int OPENING_STONES = 4;
+const int OPENING_RADIUS = 3; // grids from the center
+const int OPENING_VCF_DEPTH = 16;
+const int OPENING_VCT_DEPTH = 6;
+const int OPENING_SOLVER_NODE_LIMIT = 20000;
+const int PROGRESS_INTERVAL = 100; // games
+const int RULE_RENJU = 4; // bit of Gomocup INFO rule
+
+struct EngineConfig
+{
+	const char *path = NULL; // NULL for MCTS in this process
+	int moveTime = 100; // milliseconds
+	int threadNum = 1;
+	int treeNum = 1;
+	int memory = 0; // in MB, 0 means no limit
+};
+
+struct MatchConfig
+{
+	EngineConfig engines[2];
+	int gameNum = 1000; // at most, SPRT may stop earlier
+	int parallelNum = 0; // games played at once, 0 means hardware threads divided by threads of an engine
+	int openingStones = OPENING_STONES;
+	uint64_t seed = 1;
+
+	// SPRT of elo0 against elo1 for engine 1
+	float elo0 = 0;
+	float elo1 = 5;
+	float alpha = 0.05f;
+	float beta = 0.05f;
+};
+
+class Player
+{
+public:
+	virtual ~Player() {}
+	virtual bool NewGame() { return true; }
+	virtual int Play(Game &game) = 0; // -1 if the engine fails
+};
+
+class MctsPlayer : public Player
+{
+public:
+	MctsPlayer(const EngineConfig &config, uint64_t seed);
+	int Play(Game &game);
+
+private:
+	MCTS ai;
+	int moveTime;
+};
+
+// another engine process, it is sent the whole board before each move so it never has to follow the game
+class PipePlayer : public Player
+{
+public:
+	PipePlayer(const EngineConfig &config);
+	~PipePlayer();
+	bool NewGame();
+	int Play(Game &game);
+
+private:
+	bool Send(const string &line);
+	bool Receive(string &line); // skips MESSAGE and DEBUG lines
+
+	pid_t pid;
+	FILE *input, *output; // stdin and stdout of the engine
+	int moveTime;
+	int threadNum;
+	int memory;
+};
+
+class Match
+{
+public:
+	Match(const MatchConfig &config);
+	void Run();
+
+private:
+	void GenerateOpenings();
+	void PlayerThread(int id);
+	int PlayGame(Player *players[2], const vector<int> &opening, int firstEngine); // result for engine 1: 1 win, 0 draw, -1 loss
+	unique_ptr<Player> CreatePlayer(int engine, uint64_t seed);
+
+	void AddResult(int result);
+	void PrintResult();
+	float CalcLLR();
+
+	MatchConfig config;
+	vector<vector<int>> openings;
+	atomic<int> nextGame;
+	atomic<bool> isFinished;
+
+	mutex mtx;
+	int wins, draws, losses;
+};
+
+MctsPlayer::MctsPlayer(const EngineConfig &config, uint64_t seed)
+{
+	moveTime = config.moveTime;
+
+	ai.SetSeed(seed);
+	ai.SetThreadNum(config.threadNum);
+	ai.SetTreeNum(config.treeNum);
+	ai.SetMemoryLimit((size_t)config.memory << 20);
+	ai.SetVerbose(false);
+	TreeLogConfig treeLog;
+	treeLog.level = TreeLogConfig::E_NONE;
+	ai.SetTreeLog(treeLog);
+}
+
+int MctsPlayer::Play(Game &game)
+{
+	// nothing is sent between engines in this process, so no time is kept back
+	TimeBudget budget(moveTime);
+	budget.reserve = 0;
+	return ai.Search(&game, budget);
+}
+
+PipePlayer::PipePlayer(const EngineConfig &config)
+{
+	moveTime = config.moveTime;
+	threadNum = config.threadNum;
+	memory = config.memory;
+	input = output = NULL;
+
+	// pipes of the engines started by other game threads must not be inherited, an engine would never see the end of its input
+	int toEngine[2], fromEngine[2];
+	if (pipe2(toEngine, O_CLOEXEC) != 0 || pipe2(fromEngine, O_CLOEXEC) != 0)
+	{
+		pid = -1;
+		return;
+	}
+
+	pid = fork();
+	if (pid == 0)
+	{
+		dup2(toEngine[0], STDIN_FILENO);
+		dup2(fromEngine[1], STDOUT_FILENO);
+		close(toEngine[0]); close(toEngine[1]);
+		close(fromEngine[0]); close(fromEngine[1]);
+
+		execl(config.path, config.path, (char*)NULL);
+		_exit(127);
+	}
+
+	close(toEngine[0]);
+	close(fromEngine[1]);
+	input = fdopen(toEngine[1], "w");
+	output = fdopen(fromEngine[0], "r");
+}
+
+PipePlayer::~PipePlayer()
+{
+	if (input != NULL)
+	{
+		Send("END");
+		fclose(input);
+	}
+	if (output != NULL)
+		fclose(output);
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+}
+
+bool PipePlayer::NewGame()
+{
+	string line;
+	if (pid <= 0 || !Send("START " + to_string(BOARD_SIZE)) || !Receive(line) || line != "OK")
+		return false;
+
+	return Send("INFO timeout_turn " + to_string(moveTime)) && Send("INFO timeout_match 0") &&
+		Send("INFO thread_num " + to_string(threadNum)) && Send("INFO max_memory " + to_string((size_t)memory << 20)) &&
+		Send(string("INFO rule ") + (RESTRICTED_MOVE_RULE ? to_string(RULE_RENJU) : "0"));
+}
+
+int PipePlayer::Play(Game &game)
+{
+	// own stones are the ones of the side to move
+	const vector<uint8_t> &record = game.GetRecord();
+	string board = "BOARD\n";
+	for (int i = 0; i < record.size(); ++i)
+	{
+		int row, col;
+		Board::Id2Coord(record[i], row, col);
+		bool isOwn = (i % 2) == (record.size() % 2);
+		board += to_string(col) + "," + to_string(row) + (isOwn ? ",1\n" : ",2\n");
+	}
+	board += "DONE";
+
+	string line;
+	if (!Send(board) || !Receive(line))
+		return -1;
+
+	int x, y;
+	if (sscanf(line.c_str(), "%d,%d", &x, &y) != 2 || !Board::IsValidCoord(y, x))
+		return -1;
+
+	return Board::Coord2Id(y, x);
+}
+
+bool PipePlayer::Send(const string &line)
+{
+	return fprintf(input, "%s\n", line.c_str()) > 0 && fflush(input) == 0;
+}
+
+bool PipePlayer::Receive(string &line)
+{
+	char buffer[256];
+	while (fgets(buffer, sizeof(buffer), output) != NULL)
+	{
+		buffer[strcspn(buffer, "\r\n")] = 0;
+		if (strncmp(buffer, "MESSAGE", 7) == 0 || strncmp(buffer, "DEBUG", 5) == 0)
+			continue;
+
+		line = buffer;
+		return true;
+	}
+	return false;
+}
+
+Match::Match(const MatchConfig &config) : config(config)
+{
+	nextGame = 0;
+	isFinished = false;
+	wins = draws = losses = 0;
+}
+
+void Match::Run()
+{
+	GenerateOpenings();
+
+	int threadNum = max(config.engines[0].threadNum, config.engines[1].threadNum);
+	int parallelNum = config.parallelNum;
+	if (parallelNum <= 0)
+		parallelNum = max((int)thread::hardware_concurrency() / threadNum, 1);
+
+	printf("%d games, %d at once, %d openings, restricted move rule: %s\n", config.gameNum, parallelNum, (int)openings.size(),
+		RESTRICTED_MOVE_RULE ? "on" : "off");
+	for (int i = 0; i < 2; ++i)
+	{
+		const EngineConfig &engine = config.engines[i];
+		printf("engine %d: %s, %d ms per move, %d threads, %d trees\n", i + 1, engine.path != NULL ? engine.path : "MCTS",
+			engine.moveTime, engine.threadNum, engine.treeNum);
+	}
+
+	vector<thread> threads;
+	for (int i = 0; i < parallelNum; ++i)
+		threads.emplace_back(&Match::PlayerThread, this, i);
+	for (auto &item : threads)
+		item.join();
+
+	PrintResult();
+}
+
+void Match::GenerateOpenings()
+{
+	Random random(config.seed);
+	ThreatSolver solver;
+	int center = BOARD_SIZE / 2;
+
+	int openingNum = (config.gameNum + 1) / 2;
+	while (openings.size() < openingNum)
+	{
+		Game game;
+		game.SetLogLevel(Game::E_LOG_NONE);
+
+		vector<int> opening;
+		while (opening.size() < config.openingStones && game.GetState() == GameBase::E_NORMAL)
+		{
+			int row = center + random.Next(OPENING_RADIUS * 2 + 1) - OPENING_RADIUS;
+			int col = center + random.Next(OPENING_RADIUS * 2 + 1) - OPENING_RADIUS;
+			int id = Board::Coord2Id(row, col);
+			if (game.PutChess(id))
+				opening.push_back(id);
+		}
+
+		// not balanced if the side to move wins by threats, or a restricted move has ended the game
+		GameBase &state = (GameBase&)game;
+		if (state.state != GameBase::E_NORMAL)
+			continue;
+		if (solver.Solve(state, ThreatSolver::E_VCF, OPENING_VCF_DEPTH, OPENING_SOLVER_NODE_LIMIT) != -1 ||
+			solver.Solve(state, ThreatSolver::E_VCT, OPENING_VCT_DEPTH, OPENING_SOLVER_NODE_LIMIT) != -1)
+			continue;
+
+		openings.push_back(opening);
+	}
+}
+
+unique_ptr<Player> Match::CreatePlayer(int engine, uint64_t seed)
+{
+	const EngineConfig &engineConfig = config.engines[engine];
+	if (engineConfig.path != NULL)
+		return unique_ptr<Player>(new PipePlayer(engineConfig));
+
+	return unique_ptr<Player>(new MctsPlayer(engineConfig, seed));
+}
+
+void Match::PlayerThread(int id)
+{
+	// engines are kept for all games of this thread, trees are not reused between games as the records differ
+	unique_ptr<Player> players[2];
+	for (int i = 0; i < 2; ++i)
+		players[i] = CreatePlayer(i, config.seed * 1000 + id * 2 + i);
+
+	Player *pair[2] = { players[0].get(), players[1].get() };
+
+	while (!isFinished)
+	{
+		int index = nextGame++;
+		if (index >= config.gameNum)
+			break;
+
+		// engine 1 is black in even games and white in odd games of the same opening
+		int result = PlayGame(pair, openings[index / 2], index % 2);
+		AddResult(result);
+	}
+}
+
+int Match::PlayGame(Player *players[2], const vector<int> &opening, int firstEngine)
+{
+	Game game;
+	game.SetLogLevel(Game::E_LOG_NONE);
+
+	for (int i = 0; i < 2; ++i)
+	{
+		if (!players[i]->NewGame())
+			return (i == 0) ? -1 : 1; // an engine which can not start loses
+	}
+
+	// stones of the opening are black and white in turn, engine 1 plays the side of firstEngine
+	for (int id : opening)
+		game.PutChess(id);
+
+	while (game.GetState() == GameBase::E_NORMAL)
+	{
+		int side = (game.GetTurn() % 2 == 1) ? Board::E_BLACK : Board::E_WHITE;
+		int engine = ((side == Board::E_BLACK) == (firstEngine == 0)) ? 0 : 1;
+
+		int id = players[engine]->Play(game);
+		if (id < 0 || !game.PutChess(id))
+			return (engine == 0) ? -1 : 1; // an illegal move loses
+	}
+
+	if (game.GetState() == GameBase::E_DRAW)
+		return 0;
+
+	bool isBlackWin = (game.GetState() == GameBase::E_BLACK_WIN);
+	return (isBlackWin == (firstEngine == 0)) ? 1 : -1;
+}
+
+void Match::AddResult(int result)
+{
+	lock_guard<mutex> lock(mtx);
+
+	if (result > 0)
+		++wins;
+	else if (result < 0)
+		++losses;
+	else
+		++draws;
+
+	if (isFinished)
+		return;
+
+	int num = wins + draws + losses;
+	float llr = CalcLLR();
+	float lower = log(config.beta / (1 - config.alpha));
+	float upper = log((1 - config.beta) / config.alpha);
+	if (llr <= lower || llr >= upper)
+		isFinished = true; // games being played are still counted
+
+	if (num % PROGRESS_INTERVAL == 0 || isFinished)
+		printf("games: %d, +%d =%d -%d, llr: %.2f (%.2f, %.2f)\n", num, wins, draws, losses, llr, lower, upper);
+}
+
+float Match::CalcLLR()
+{
+	// normal approximation of the generalized SPRT on the score of each game, with the variance measured so far
+	int num = wins + draws + losses;
+	if (num == 0 || wins + losses == 0)
+		return 0;
+
+	double score = (wins + draws * 0.5) / num;
+	double variance = (wins * pow(1 - score, 2) + draws * pow(0.5 - score, 2) + losses * pow(score, 2)) / num;
+	if (variance <= 0)
+		return 0;
+
+	double score0 = 1 / (1 + pow(10, -config.elo0 / 400));
+	double score1 = 1 / (1 + pow(10, -config.elo1 / 400));
+	return (float)(num * (score1 - score0) * (2 * score - score0 - score1) / (2 * variance));
+}
+
+void Match::PrintResult()
+{
+	lock_guard<mutex> lock(mtx);
+
+	int num = wins + draws + losses;
+	if (num == 0)
+		return;
+
+	double score = (wins + draws * 0.5) / num;
+	double variance = (wins * pow(1 - score, 2) + draws * pow(0.5 - score, 2) + losses * pow(score, 2)) / num;
+	double margin = 1.96 * sqrt(variance / num);
+
+	auto calcElo = [](double score)
+	{
+		score = min(max(score, 1e-6), 1 - 1e-6);
+		return -400 * log10(1 / score - 1);
+	};
+
+	float llr = CalcLLR();
+	float lower = log(config.beta / (1 - config.alpha));
+	float upper = log((1 - config.beta) / config.alpha);
+	const char *verdict = (llr >= upper) ? "H1 accepted, engine 1 is stronger" :
+		(llr <= lower) ? "H0 accepted, engine 1 is not stronger" : "inconclusive";
+
+	printf("=== result of engine 1 ===\n");
+	printf("games: %d, wins: %d, draws: %d, losses: %d\n", num, wins, draws, losses);
+	printf("score: %.1f%%, elo: %.1f (%.1f, %.1f), draw rate: %.1f%%\n", score * 100, calcElo(score),
+		calcElo(score - margin), calcElo(score + margin), draws * 100.0 / num);
+	printf("sprt [%.1f, %.1f]: llr %.2f (%.2f, %.2f), %s\n", config.elo0, config.elo1, llr, lower, upper, verdict);
+}
+
+int main(int argc, char *argv[])
+{
+	MatchConfig config;
+	signal(SIGPIPE, SIG_IGN); // an engine process which exits only loses its games
+
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		const char *name = argv[i];
+		const char *value = argv[i + 1];
+
+		// engine options without a number are for both engines
+		int last = strlen(name) - 1;
+		int engine = (name[last] == '1' || name[last] == '2') ? name[last] - '1' : -1;
+		string option = (engine == -1) ? name : string(name, last);
+
+		bool isEngineOption = true;
+		for (int j = 0; j < 2; ++j)
+		{
+			if (engine != -1 && engine != j)
+				continue;
+
+			EngineConfig &engineConfig = config.engines[j];
+			if (option == "--engine")
+				engineConfig.path = value;
+			else if (option == "--time")
+				engineConfig.moveTime = atoi(value);
+			else if (option == "--threads")
+				engineConfig.threadNum = atoi(value);
+			else if (option == "--trees")
+				engineConfig.treeNum = atoi(value);
+			else if (option == "--memory")
+				engineConfig.memory = atoi(value);
+			else
+				isEngineOption = false;
+		}
+		if (isEngineOption)
+			continue;
+
+		if (strcmp(name, "--games") == 0)
+			config.gameNum = atoi(value);
+		else if (strcmp(name, "--parallel") == 0)
+			config.parallelNum = atoi(value);
+		else if (strcmp(name, "--opening") == 0)
+			config.openingStones = min(max(atoi(value), 0), OPENING_RADIUS * 2 * OPENING_RADIUS * 2); // leaves room for random stones
+		else if (strcmp(name, "--seed") == 0)
+			config.seed = strtoull(value, NULL, 10);
+		else if (strcmp(name, "--elo0") == 0)
+			config.elo0 = atof(value);
+		else if (strcmp(name, "--elo1") == 0)
+			config.elo1 = atof(value);
+		else if (strcmp(name, "--alpha") == 0)
+			config.alpha = atof(value);
+		else if (strcmp(name, "--beta") == 0)
+			config.beta = atof(value);
+		else
+		{
+			printf("usage: gobang_match [--games N] [--parallel N] [--opening stones] [--seed N] [--elo0 elo] [--elo1 elo] [--alpha a] [--beta b]\n");
+			printf("                    [--engine[1|2] path] [--time[1|2] ms] [--threads[1|2] N] [--trees[1|2] N] [--memory[1|2] MB]\n");
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		const EngineConfig &engine = config.engines[i];
+		if (engine.moveTime <= 0)
+		{
+			printf("time of engine %d must be positive\n", i + 1);
+			return 1;
+		}
+
+		// a brain keeps part of its time for sending the move, see TimeBudget
+		if (engine.path != NULL && engine.moveTime <= TimeBudget().reserve)
+			printf("warning: engine %d searches less than its %d ms per move, it keeps some for sending the move\n", i + 1, engine.moveTime);
+	}
+
+	Match match(config);
+	match.Run();
+
+	return 0;
+}
@@ -3,209 +3,1165 @@
 #include <mutex>
 #include <cmath>
 #include <cstdlib>
+#include <algorithm>
+#include <random>
 #include "mcts.h"
+#include "log.h"
 
 const char* LOG_FILE = "MCTS.log";
 const char* LOG_FILE_FULL = "MCTS_FULL.log";
+const char* LOG_FILE_BINARY = "MCTS.bin";
+const char* LOG_FILE_FULL_BINARY = "MCTS_FULL.bin";
 const float Cp = 2.0f;
-const float SEARCH_TIME = 1.0f;
+const float SEARCH_TIME = 1.0f; // default time per move in seconds
 const int	EXPAND_THRESHOLD = 3;
 const bool	ENABLE_MULTI_THREAD = true;
+const bool	ENABLE_THREAD_AFFINITY = false; // see SetThreadAffinity
+const int	TREE_NUM = 1; // threads are split between this many independent trees, see SetTreeNum
+const float	TREE_SYNC_INTERVAL = 0.05f; // in seconds
+const bool	ENABLE_LOCK_FREE = true;
+const bool	ENABLE_TREE_REUSE = true;
+const bool	ENABLE_TRANSPOSITION = true;
+const int	VIRTUAL_LOSS = 1;
 const float	FAST_STOP_THRESHOLD = 0.1f;
 const float	FAST_STOP_BRANCH_FACTOR = 0.01f;
 
 const bool	ENABLE_TRY_MORE_NODE = true;
 const int	TRY_MORE_NODE_THRESHOLD = 1000;
 
-TreeNode::TreeNode(TreeNode *p)
+const int	NODE_ARENA_SIZE = 1 << 22;
+const int	TRANS_TABLE_SIZE = 1 << 18;
+const int	TRANS_TABLE_PROBE = 4;
+const size_t MEMORY_RESERVE = 32 << 20; // tables, caches and stacks which are not part of the tree, see SetMemoryLimit
+
+const int	MOVES_TO_GO = 20; // moves left in game assumed by time control
+const float	MAX_TIME_FACTOR = 3.0f;
+const int	RESERVE_DIVISOR = 10; // TimeBudget.reserve takes at most this part of a limit, so a short one keeps most of its time
+const bool	ENABLE_PHASE_TIMER = true; // time each search phase for SearchStats
+const bool	ENABLE_EARLY_STOP = true;
+const int	STOP_CHECK_INTERVAL = 64;
+
+const bool	ENABLE_MCTS_SOLVER = true; // back up proven results, see UpdateProven
+
+const bool	ENABLE_THREAT_SOLVER = true;
+const int	VCF_DEPTH = 16; // attacking moves
+const int	VCT_DEPTH = 6;
+const int	ROOT_SOLVER_NODE_LIMIT = 5000; // for each of VCF and VCT before search
+const int	VCT_PRIOR_VISIT = 32; // won visits a root move found by VCT starts with
+const int	SOLVER_VISIT_THRESHOLD = 8; // tree nodes are checked by VCF once they are visited this many times
+const int	TREE_SOLVER_NODE_LIMIT = 200;
+
+TreeNode::TreeNode()
 {
 	visit = 0;
 	value = 0;
 	winRate = 0;
 	expandFactor = 0;
-	validGridCount = 0;
+	virtualLoss = 0;
+	isExpanding = false;
+	move = 0;
+	side = 0;
+	state = GameBase::E_NORMAL;
 	gridLevel = 0;
-	game = NULL;
-	parent = p;
+	isThreatChecked = false;
+	link = NODE_NULL;
+	firstChild = NODE_NULL;
+	childCount = 0;
+	childLimit = 0;
+	childCapacity = 0;
 }
 
-FILE *fp;
+void TreeNode::CopyStats(const TreeNode &node)
+{
+	visit = node.visit.load();
+	value = node.value.load();
+	winRate = node.winRate.load();
+	expandFactor = node.expandFactor.load();
+	move = node.move;
+	side = node.side;
+	state = node.state.load();
+	gridLevel = node.gridLevel;
+	isThreatChecked = node.isThreatChecked;
+	childLimit = node.childLimit;
+}
+
+NodeArena::NodeArena()
+{
+	// pages are only touched when nodes are allocated, so a large arena costs nothing until used
+	capacity = NODE_ARENA_SIZE;
+	nodes = (TreeNode*)malloc(sizeof(TreeNode) * capacity);
+	top = 0;
+}
+
+NodeArena::~NodeArena()
+{
+	free(nodes);
+}
+
+void NodeArena::SetCapacity(uint32_t num)
+{
+	// a smaller block also bounds the address space, which matters for many engines in one process
+	free(nodes);
+	capacity = min(num, (uint32_t)NODE_ARENA_SIZE);
+	nodes = (TreeNode*)malloc(sizeof(TreeNode) * capacity);
+	top = 0;
+}
+
+uint32_t NodeArena::Allocate(int count)
+{
+	// top only moves when the block fits, so it never runs past capacity however many allocations fail
+	uint32_t index = top.load(memory_order_relaxed);
+	do
+	{
+		if (index + count > capacity)
+			return NODE_NULL;
+	} while (!top.compare_exchange_weak(index, index + count, memory_order_relaxed));
+
+	for (int i = 0; i < count; ++i)
+		new (&nodes[index + i]) TreeNode();
+
+	return index;
+}
+
+TransTable::TransTable()
+{
+	table = new Entry[TRANS_TABLE_SIZE];
+	mask = TRANS_TABLE_SIZE - 1;
+	Clear();
+}
+
+TransTable::~TransTable()
+{
+	delete[] table;
+}
+
+uint32_t TransTable::Insert(uint64_t key, uint32_t node)
+{
+	if (key == 0)
+		key = 1; // 0 marks empty entry
+
+	for (int i = 0; i < TRANS_TABLE_PROBE; ++i)
+	{
+		Entry &entry = table[(key + i) & mask];
+
+		uint64_t oldKey = entry.key.load(memory_order_acquire);
+		if (oldKey == 0 && entry.key.compare_exchange_strong(oldKey, key, memory_order_acq_rel))
+		{
+			entry.node.store(node, memory_order_release);
+			return node;
+		}
+
+		if (oldKey == key)
+		{
+			uint32_t owner = entry.node.load(memory_order_acquire);
+			return (owner == NODE_NULL) ? node : owner; // owner is still being stored, do not wait for it
+		}
+	}
+	return node;
+}
+
+void TransTable::Clear()
+{
+	for (uint32_t i = 0; i <= mask; ++i)
+	{
+		table[i].key.store(0, memory_order_relaxed);
+		table[i].node.store(NODE_NULL, memory_order_relaxed);
+	}
+}
+
+static void AtomicAdd(atomic<float> &target, float value)
+{
+	float old = target.load(memory_order_relaxed);
+	while (!target.compare_exchange_weak(old, old + value, memory_order_relaxed));
+}
+
+int64_t GetTimeNs()
+{
+	if (!ENABLE_PHASE_TIMER)
+		return 0;
+
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SearchStats::Clear()
+{
+	threadNum = 0;
+	iterations = 0;
+	maxDepth = 0;
+	time = 0;
+	selectTime = expandTime = rolloutTime = updateTime = 0;
+	lockWaitTime = 0;
+	threadLockWaitTime.fill(0);
+	nodeCount = nodeAllocFail = 0;
+	transHit = transMiss = 0;
+	expandCollision = 0;
+	solverCount = 0;
+	solverWin = 0;
+	fastStopCount = fastStopSteps = 0;
+	rolloutLength.fill(0);
+}
+
+void SearchStats::Merge(const SearchStats &stats)
+{
+	iterations += stats.iterations;
+	maxDepth = max(maxDepth, stats.maxDepth);
+	selectTime += stats.selectTime;
+	expandTime += stats.expandTime;
+	rolloutTime += stats.rolloutTime;
+	updateTime += stats.updateTime;
+	lockWaitTime += stats.lockWaitTime;
+	nodeCount += stats.nodeCount;
+	nodeAllocFail += stats.nodeAllocFail;
+	transHit += stats.transHit;
+	transMiss += stats.transMiss;
+	expandCollision += stats.expandCollision;
+	solverCount += stats.solverCount;
+	solverWin += stats.solverWin;
+	fastStopCount += stats.fastStopCount;
+	fastStopSteps += stats.fastStopSteps;
+
+	for (int i = 0; i < ROLLOUT_HISTOGRAM_SIZE; ++i)
+		rolloutLength[i] += stats.rolloutLength[i];
+}
 
 MCTS::MCTS(int mode)
 {
 	this->mode = mode;
 
 	root = NULL;
-
-	// clear log file
-	fopen_s(&fp, LOG_FILE, "w");
-	fclose(fp);
+	nodes = &arena[0];
+	threadNum = 1;
+	threadNumLimit = 0;
+	treeNum = 1;
+	treeNumLimit = TREE_NUM;
+	enablePonder = false;
+	isPondering = false;
+	pool.SetAffinity(ENABLE_THREAD_AFFINITY);
+
+	// rand() is shared by the process, engines created at the same time would race on it
+	random_device device;
+	random.Seed(((uint64_t)device() << 32) | device());
+
+	verbose = true;
 }
 
 MCTS::~MCTS()
 {
-	ClearPool();
+	StopPonder();
 }
 
-mutex mtx;
+void MCTS::SetMemoryLimit(size_t bytes)
+{
+	StopPonder();
+
+	uint32_t capacity = NODE_ARENA_SIZE;
+	if (bytes > 0)
+	{
+		// both arenas hold a tree while it is reused
+		size_t treeBytes = bytes - min(bytes, MEMORY_RESERVE + transTable.MemorySize());
+		capacity = (uint32_t)min(treeBytes / (sizeof(TreeNode) * 2), (size_t)NODE_ARENA_SIZE);
+		capacity = max(capacity, (uint32_t)(GRID_NUM * 2)); // room for root and its children at least
+	}
+
+	if (capacity == arena[0].GetCapacity())
+		return;
+
+	for (auto &item : arena)
+		item.SetCapacity(capacity);
+	root = NULL; // the tree is dropped with the arenas
+}
 
-void MCTS::SearchThread(int id, int seed, MCTS *mcts, clock_t startTime)
+void MCTS::SearchThread(int id, MCTS *mcts)
 {
-	srand(seed); // need to call srand for each thread
-	float elapsedTime = 0;
+	SearchStats &stats = mcts->statsCache[id];
 
-	while (1)
+	for (int iteration = 1; ; ++iteration)
 	{
-		mtx.lock();
-		TreeNode *node = mcts->TreePolicy(mcts->root);
-		mtx.unlock();
+		int64_t time0 = GetTimeNs();
+		if (!ENABLE_LOCK_FREE)
+			mcts->treeMutex.lock();
+		int64_t time1 = GetTimeNs();
+		TreeNode *node = mcts->TreePolicy(mcts->trees[id % mcts->treeNum], id);
+		if (!ENABLE_LOCK_FREE)
+			mcts->treeMutex.unlock();
+		int64_t time2 = GetTimeNs();
+
+		stats.maxDepth = max(stats.maxDepth, mcts->gameCache[id].turn - mcts->rootGame.turn);
 
 		float value = mcts->DefaultPolicy(node, id);
+		int64_t time3 = GetTimeNs();
+
+		if (!ENABLE_LOCK_FREE)
+			mcts->treeMutex.lock();
+		int64_t time4 = GetTimeNs();
+		mcts->UpdateValue(id, value);
+		if (!ENABLE_LOCK_FREE)
+			mcts->treeMutex.unlock();
+		int64_t time5 = GetTimeNs();
+
+		if (!ENABLE_LOCK_FREE)
+			stats.lockWaitTime += (time1 - time0) + (time4 - time3);
+		stats.selectTime += time2 - time1;
+		stats.rolloutTime += time3 - time2;
+		stats.updateTime += time5 - time4;
+		stats.iterations++;
+
+		if (mcts->CheckStop(iteration))
+			break;
+
+		if (id == 0 && mcts->treeNum > 1 && mcts->GetElapsedTime() - mcts->lastSyncTime > TREE_SYNC_INTERVAL)
+		{
+			mcts->SyncTrees();
+			mcts->lastSyncTime = mcts->GetElapsedTime();
+		}
+	}
 
-		mtx.lock();
-		mcts->UpdateValue(node, value);
-		mtx.unlock();
+	stats.selectTime -= stats.expandTime; // expansion is timed inside TreePolicy
+}
+
+int MCTS::GetThreadNum()
+{
+	int num = ENABLE_MULTI_THREAD ? thread::hardware_concurrency() : 1;
+	if (threadNumLimit > 0)
+		num = threadNumLimit;
+	return min(max(num, 1), THREAD_NUM_MAX);
+}
+
+void MCTS::InitThreads()
+{
+	threadNum = GetThreadNum();
+
+	for (int i = 0; i < threadNum; ++i)
+	{
+		randomCache[i].Seed(random.Next());
+		statsCache[i].Clear();
+	}
+}
 
-		elapsedTime = float(clock() - startTime) / 1000;
-		if (elapsedTime > SEARCH_TIME)
+void MCTS::StartThreads()
+{
+	InitThreads();
+	pool.Run(threadNum, [this](int id) { SearchThread(id, this); });
+}
+
+void MCTS::JoinThreads()
+{
+	pool.Wait();
+}
+
+void MCTS::RunThreads()
+{
+	InitThreads();
+
+	// one thread searches on the caller, so a search started from another pool does not wake up a thread of its own
+	if (threadNum == 1)
+	{
+		SearchThread(0, this);
+		return;
+	}
+
+	pool.Run(threadNum, [this](int id) { SearchThread(id, this); });
+	pool.Wait();
+}
+
+void MCTS::StartPonder(TreeNode *node)
+{
+	if (!enablePonder || !ENABLE_TREE_REUSE || node->state != GameBase::E_NORMAL)
+		return;
+
+	// search the position after our move, values are still counted for searchSide,
+	// so the tree matches the next search after opponent moves
+	rootGame.PutChess(node->move);
+	rootRecord.push_back(node->move);
+	root = node;
+	trees[0] = root;
+	treeNum = 1; // other trees are not kept after search
+
+	startTime = chrono::steady_clock::now();
+	startVisit = root->visit;
+	stopSearch = false;
+	isPondering = true;
+
+	StartThreads();
+}
+
+void MCTS::StopPonder()
+{
+	if (!isPondering)
+		return;
+
+	stopSearch = true;
+	JoinThreads();
+	isPondering = false;
+
+	if (verbose)
+		printf("ponder: time: %.2f, iteration: %d\n", GetElapsedTime(), (int)root->visit - startVisit);
+}
+
+void MCTS::InitTrees()
+{
+	treeNum = min(max(treeNumLimit, 1), GetThreadNum());
+	trees[0] = root;
+
+	for (int i = 1; i < treeNum; ++i)
+	{
+		uint32_t nodeId = nodes->Allocate(1);
+		if (nodeId == NODE_NULL)
 		{
-			mtx.lock();
-			TreeNode *mostVisit = *max_element(mcts->root->children.begin(), mcts->root->children.end(), [](const TreeNode *a, const TreeNode *b)
-			{
-				return a->visit < b->visit;
-			});
+			treeNum = i;
+			break;
+		}
+
+		TreeNode *node = &(*nodes)[nodeId];
+		node->move = root->move;
+		node->side = root->side;
+		node->state = root->state.load();
+		trees[i] = node;
+	}
+
+	if (treeNum == 1)
+		return;
 
-			TreeNode *bestScore = mcts->BestChild(mcts->root, 0);
-			mtx.unlock();
+	lastSyncTime = 0;
+	totalVisit.fill(0);
+	totalValue.fill(0);
+	for (int i = 0; i < treeNum; ++i)
+	{
+		syncVisit[i].fill(0);
+		syncValue[i].fill(0);
+	}
+
+	// a reused tree 0 is where merged stats start from
+	totalVisit[GRID_NUM] = syncVisit[0][GRID_NUM] = root->visit;
+	totalValue[GRID_NUM] = syncValue[0][GRID_NUM] = root->value;
+
+	for (int i = 0; i < root->childCount; ++i)
+	{
+		TreeNode &child = GetChildren(root)[i];
+		totalVisit[child.move] = syncVisit[0][child.move] = child.visit;
+		totalValue[child.move] = syncValue[0][child.move] = child.value;
+	}
+}
+
+void MCTS::SyncTrees()
+{
+	auto forEachSlot = [this](int tree, auto func)
+	{
+		TreeNode *node = trees[tree];
+		func(GRID_NUM, node);
+
+		int childCount = node->childCount.load(memory_order_acquire);
+		if (childCount == 0)
+			return;
+
+		TreeNode *children = GetChildren(node);
+		for (int i = 0; i < childCount; ++i)
+			func(children[i].move, &children[i]);
+	};
+
+	// add what each tree has searched since last sync, a proven result in one tree holds for all of them
+	array<char, GRID_NUM + 1> totalState;
+	totalState.fill(GameBase::E_NORMAL);
+
+	for (int i = 0; i < treeNum; ++i)
+	{
+		forEachSlot(i, [&](int slot, TreeNode *node)
+		{
+			totalVisit[slot] += node->visit - syncVisit[i][slot];
+			totalValue[slot] += node->value - syncValue[i][slot];
+
+			if (node->state != GameBase::E_NORMAL)
+				totalState[slot] = node->state;
+		});
+	}
+
+	// playouts finishing in between are lost, which does not matter for a few of them
+	for (int i = 0; i < treeNum; ++i)
+	{
+		forEachSlot(i, [&](int slot, TreeNode *node)
+		{
+			SetNodeStats(node, totalVisit[slot], totalValue[slot]);
+			syncVisit[i][slot] = totalVisit[slot];
+			syncValue[i][slot] = totalValue[slot];
+
+			if (totalState[slot] != GameBase::E_NORMAL)
+				node->state = totalState[slot];
+		});
+	}
+}
+
+void MCTS::ExpandTreeMoves()
+{
+	// SyncTrees merges by move, but the best move is chosen from tree 0, so a move searched only by other trees would be lost
+	array<bool, GRID_NUM> isSearched;
+	isSearched.fill(false);
+
+	for (int i = 1; i < treeNum; ++i)
+	{
+		int childCount = trees[i]->childCount;
+		for (int j = 0; j < childCount; ++j)
+			isSearched[GetChildren(trees[i])[j].move] = true;
+	}
+
+	for (int move = 0; move < GRID_NUM; ++move)
+	{
+		if (isSearched[move])
+			ExpandRootMove(move);
+	}
+}
+
+TreeNode* MCTS::ExpandRootMove(int move)
+{
+	if (root->firstChild == NODE_NULL)
+	{
+		gameCache[0] = rootGame;
+		if (!AllocateChildren(root, 0))
+			return NULL;
+	}
 
-			if (mostVisit == bestScore)
-				break;
+	TreeNode *children = GetChildren(root);
+	int childCount = root->childCount;
+
+	for (int i = 0; i < root->childCapacity; ++i)
+	{
+		if (children[i].move != move)
+			continue;
+
+		if (i < childCount)
+			return &children[i];
+
+		// children not expanded yet differ only in move, so this one is swapped to the end of the expanded ones
+		swap(children[i].move, children[childCount].move);
+		if (childCount >= root->childLimit)
+		{
+			root->gridLevel = 1;
+			root->childLimit = root->childCapacity;
 		}
+
+		GameBase &game = gameCache[0];
+		game = rootGame;
+		game.PutChess(move);
+		children[childCount].state = game.state;
+		root->childCount = childCount + 1;
+		return &children[childCount];
 	}
+	return NULL; // no room for children or not a valid move
+}
+
+void MCTS::SetNodeStats(TreeNode *node, int visit, float value)
+{
+	node->visit = visit;
+	node->value = value;
+
+	if (visit == 0)
+		return;
+
+	float winRate = value / visit;
+	if (node->side == searchSide) // win rate of opponent
+		winRate = 1 - winRate;
+
+	node->expandFactor = sqrtf(1.f / visit);
+	node->winRate = winRate;
+}
+
+void MCTS::InitTimeControl(const TimeBudget &budget)
+{
+	startVisit = root->visit;
+	stopSearch = false;
+
+	if (budget.moveTime == 0 && budget.totalTime == 0)
+	{
+		optimumTime = SEARCH_TIME;
+		maximumTime = SEARCH_TIME * MAX_TIME_FACTOR;
+		return;
+	}
+
+	auto getReserve = [&budget](int limit) { return min(budget.reserve, limit / RESERVE_DIVISOR); };
+
+	maximumTime = 1e9f;
+	if (budget.moveTime > 0)
+		maximumTime = (budget.moveTime - getReserve(budget.moveTime)) / 1000.f;
+
+	optimumTime = maximumTime;
+	if (budget.totalTime > 0)
+	{
+		float totalTime = (budget.totalTime - getReserve(budget.totalTime)) / 1000.f;
+		optimumTime = min(optimumTime, totalTime / MOVES_TO_GO + budget.increment / 1000.f);
+		maximumTime = min(maximumTime, min(optimumTime * MAX_TIME_FACTOR, totalTime / 2));
+	}
+
+	maximumTime = max(maximumTime, 0.001f);
+	optimumTime = min(max(optimumTime, 0.001f), maximumTime);
+}
+
+float MCTS::GetElapsedTime()
+{
+	return chrono::duration<float>(chrono::steady_clock::now() - startTime).count();
+}
+
+bool MCTS::CheckStop(int iteration)
+{
+	if (stopSearch.load(memory_order_relaxed))
+		return true;
+
+	// children searched by other trees are added to tree 0 at the end, see ExpandTreeMoves
+	bool hasMove = false;
+	for (int i = 0; i < treeNum && !hasMove; ++i)
+		hasMove = trees[i]->childCount > 0;
+
+	if (ENABLE_MCTS_SOLVER && root->state != GameBase::E_NORMAL && hasMove)
+	{
+		stopSearch = true; // nothing is left to search
+		return true;
+	}
+
+	// pondering has no time limit, it only ends when stopped or when there is no room for the tree
+	if (isPondering)
+		return nodes->IsFull();
+
+	float elapsedTime = GetElapsedTime();
+	if (elapsedTime > maximumTime && (hasMove || nodes->IsFull())) // keep on until there is a move to return
+	{
+		stopSearch = true;
+		return true;
+	}
+
+	bool checkEarlyStop = ENABLE_EARLY_STOP && iteration % STOP_CHECK_INTERVAL == 0;
+	if (elapsedTime < optimumTime && !checkEarlyStop)
+		return false;
+
+	if (!ENABLE_LOCK_FREE)
+		treeMutex.lock();
+
+	TreeNode *mostVisit = MostVisitChild(root);
+	TreeNode *bestScore = BestChild(root, 0);
+
+	bool shouldStop = false;
+	if (elapsedTime >= optimumTime)
+	{
+		shouldStop = (mostVisit != NULL && mostVisit == bestScore);
+	}
+	else if (mostVisit != NULL)
+	{
+		if (root->childCapacity == 1)
+		{
+			shouldStop = true; // only one move to play
+		}
+		else
+		{
+			// stop if no other child can catch up with the most visited one until optimum time
+			int secondVisit = 0;
+			TreeNode *children = GetChildren(root);
+			for (int i = 0; i < root->childCount; ++i)
+			{
+				if (&children[i] != mostVisit)
+					secondVisit = max(secondVisit, (int)children[i].visit);
+			}
+
+			float visitRate = (root->visit - startVisit) / elapsedTime;
+			float visitLeft = visitRate * (optimumTime - elapsedTime);
+			shouldStop = (mostVisit == bestScore && mostVisit->visit - secondVisit > visitLeft);
+		}
+	}
+
+	if (!ENABLE_LOCK_FREE)
+		treeMutex.unlock();
+
+	if (shouldStop)
+		stopSearch = true;
+
+	return shouldStop;
 }
 
 int MCTS::Search(Game *state)
 {
+	return Search(state, TimeBudget());
+}
+
+int MCTS::Search(Game *state, const TimeBudget &budget, SearchStats *stats)
+{
+	StopPonder();
+	startTime = chrono::steady_clock::now(); // time of threat solver is taken from the budget as well
+
 	int move = CheckBook((GameBase*)state);
 	if (move != -1)
 	{
-		printf("using book check result (no searching)\n");
+		if (verbose)
+			printf("using book check result (no searching)\n");
 		return move;
 	}
 
-	fastStopSteps = 0;
-	fastStopCount = 0;
+	int vctMove = -1;
+	if (ENABLE_THREAT_SOLVER && state->GetRecord() != noThreatRecord)
+	{
+		move = CheckThreat((GameBase*)state, vctMove);
+		if (move != -1)
+		{
+			if (verbose)
+				printf("using VCF result (no searching)\n");
+			return move;
+		}
+		noThreatRecord = state->GetRecord(); // not solved again when the same position is searched on
+	}
+
+	// the same position as last search goes on with the tree in place, so a search can be split into time slices
+	bool isSamePosition = (root != NULL && state->GetRecord() == rootRecord && root->side == searchSide);
+	if (!isSamePosition)
+	{
+		ReuseTree(state);
+		if (ENABLE_TRANSPOSITION)
+			transTable.Clear(); // node ids are changed by ReuseTree
+	}
+
+	rootGame = *((GameBase*)state);
+	searchSide = rootGame.GetSide();
+
+	if (root == NULL)
+	{
+		nodes->Reset();
+		root = &(*nodes)[nodes->Allocate(1)];
+		root->move = rootGame.lastMove;
+		root->side = rootGame.GetSide();
+		root->state = rootGame.state;
+	}
+	else if (verbose)
+	{
+		printf("reuse tree: visit: %d, children: %d\n", (int)root->visit, (int)root->childCount);
+	}
+
+	// a reused root may be proven through a link or by the threat solver without children of its own,
+	// it is searched again to find the move
+	if (root->childCount == 0)
+		root->state = rootGame.state;
 
-	root = NewTreeNode(NULL);
-	*(root->game) = *((GameBase*)state);
-	root->validGridCount = root->game->validGridCount;
-	root->validGrids = root->game->validGrids;
+	// VCT may miss a defence, so its move is searched like the others, starting with a few won visits
+	TreeNode *threatChild = (vctMove != -1) ? ExpandRootMove(vctMove) : NULL;
+	if (threatChild != NULL)
+	{
+		SetNodeStats(threatChild, threatChild->visit + VCT_PRIOR_VISIT, threatChild->value + VCT_PRIOR_VISIT);
+		SetNodeStats(root, root->visit + VCT_PRIOR_VISIT, root->value + VCT_PRIOR_VISIT);
+	}
+	rootRecord = state->GetRecord();
+
+	InitTrees();
+	InitTimeControl(budget);
+	RunThreads();
+
+	if (treeNum > 1)
+	{
+		ExpandTreeMoves();
+		SyncTrees(); // root of tree 0 gets the stats of all trees
+	}
 
-	clock_t startTime = clock();
+	SearchStats total;
+	total.threadNum = threadNum;
+	total.time = GetElapsedTime();
 
-	thread threads[THREAD_NUM_MAX];
-	int thread_num = ENABLE_MULTI_THREAD ? thread::hardware_concurrency() : 1;
+	for (int i = 0; i < threadNum; ++i)
+	{
+		total.Merge(statsCache[i]);
+		total.threadLockWaitTime[i] = statsCache[i].lockWaitTime;
+	}
 
-	for (int i = 0; i < thread_num; ++i)
-		threads[i] = thread(SearchThread, i, rand(), this, startTime);
+	if (stats != NULL)
+		*stats = total;
 
-	for (int i = 0; i < thread_num; ++i)
-		threads[i].join();
-	
 	TreeNode *best = BestChild(root, 0);
-	move = best->game->lastMove;
+	if (best == NULL)
+	{
+		// no room for children of root
+		if (verbose)
+			printf("no move is searched, playing a random one\n");
 
-	maxDepth = 0;
-	PrintTree(root);
-	PrintFullTree(root);
-	printf("time: %.2f, iteration: %d, depth: %d, win: %.2f%% (%d/%d)\n", float(clock() - startTime) / 1000, root->visit, maxDepth, best->value * 100 / best->visit, (int)best->value, best->visit);
-	printf("fast stop count: %d, average stop steps: %d\n", fastStopCount, fastStopSteps / (fastStopCount + 1));
+		move = rootGame.GetNextMove(random);
+		if (!ENABLE_TREE_REUSE)
+			root = NULL;
+		return move;
+	}
+	move = best->move;
 
-	ClearNodes(root);
+	WriteTreeLog();
+	if (verbose)
+	{
+		printf("time: %.2f, iteration: %d, depth: %d, win: %.2f%% (%d/%d)\n", total.time, (int)root->visit, total.maxDepth, best->value * 100 / best->visit, (int)best->value, (int)best->visit);
+		printf("fast stop count: %d, average stop steps: %d\n", total.fastStopCount, total.fastStopSteps / (total.fastStopCount + 1));
+		if (ENABLE_THREAT_SOLVER)
+			printf("threat solver: checked: %d, proven: %d\n", total.solverCount, total.solverWin);
+		if (root->state != GameBase::E_NORMAL)
+			printf("root is proven: %s\n", (root->state == searchSide) ? "win" : (root->state == GameBase::E_DRAW) ? "draw" : "loss");
+	}
+
+	if (!ENABLE_TREE_REUSE)
+		root = NULL;
+
+	StartPonder(best);
 
 	return move;
 }
 
-TreeNode* MCTS::TreePolicy(TreeNode *node)
+void MCTS::ReuseTree(Game *state)
+{
+	if (root == NULL)
+		return;
+
+	// follow the moves played since last search, only possible if the new position extends the old one
+	TreeNode *newRoot = NULL;
+	const vector<uint8_t> &record = state->GetRecord();
+
+	if (record.size() > rootRecord.size() && equal(rootRecord.begin(), rootRecord.end(), record.begin()))
+	{
+		newRoot = root;
+		for (int i = rootRecord.size(); i < record.size() && newRoot != NULL; ++i)
+			newRoot = FindChild(newRoot, record[i]);
+	}
+
+	// node values are counted for the side of last search, so the tree is dropped if it is not our turn any more
+	// (root is one move after that search while pondering)
+	if (newRoot != NULL && newRoot->side != searchSide)
+		newRoot = NULL;
+
+	root = NULL;
+	if (newRoot != NULL)
+	{
+		// move the subtree to the other arena, nodes of the siblings are dropped with the old arena
+		NodeArena *target = (nodes == &arena[0]) ? &arena[1] : &arena[0];
+		target->Reset();
+
+		uint32_t rootId = target->Allocate(1);
+		CopyTree(newRoot, *target, rootId);
+
+		nodes = target;
+		root = &(*nodes)[rootId];
+	}
+}
+
+TreeNode* MCTS::FindChild(TreeNode *node, int move)
+{
+	if (node->link != NODE_NULL)
+		node = &(*nodes)[node->link];
+
+	TreeNode *children = GetChildren(node);
+	for (int i = 0; i < node->childCount; ++i)
+	{
+		if (children[i].move == move)
+			return &children[i];
+	}
+	return NULL;
+}
+
+void MCTS::CopyTree(TreeNode *node, NodeArena &target, uint32_t targetId)
+{
+	target[targetId].CopyStats(*node);
+
+	if (node->firstChild == NODE_NULL)
+		return;
+
+	uint32_t firstChild = target.Allocate(node->childCapacity);
+	if (firstChild == NODE_NULL)
+		return; // out of space, keep it as a leaf
+
+	TreeNode *children = GetChildren(node);
+	for (int i = 0; i < node->childCapacity; ++i)
+	{
+		TreeNode &child = target[firstChild + i];
+		child.move = children[i].move;
+		child.side = children[i].side;
+
+		if (i < node->childCount)
+			CopyTree(&children[i], target, firstChild + i);
+	}
+
+	TreeNode &newNode = target[targetId];
+	newNode.firstChild = firstChild;
+	newNode.childCapacity = node->childCapacity;
+	newNode.childCount = node->childCount.load();
+}
+
+TreeNode* MCTS::TreePolicy(TreeNode *node, int id)
 {
-	while (node->game->state == GameBase::E_NORMAL)
+	GameBase &game = gameCache[id];
+	game = rootGame;
+
+	pathCache[id].length = 0;
+	AddToPath(id, node);
+
+	while (node->state == GameBase::E_NORMAL)
 	{
 		if (node->visit < EXPAND_THRESHOLD)
 			return node;
 
-		if (PreExpandTree(node))
-			return ExpandTree(node);
+		uint32_t link = node->link.load(memory_order_acquire);
+		if (link != NODE_NULL)
+		{
+			// same position as the linked node, continue from there without playing any move
+			node = &(*nodes)[link];
+			AddToPath(id, node);
+			continue;
+		}
+
+		TreeNode *child = NULL;
+		if (ENABLE_LOCK_FREE)
+		{
+			bool expected = false;
+			if (node->isExpanding.compare_exchange_strong(expected, true, memory_order_acquire))
+			{
+				int64_t startTime = GetTimeNs();
+				child = PreExpandTree(node, id) ? ExpandTree(node, id) : NULL;
+				statsCache[id].expandTime += GetTimeNs() - startTime;
+
+				node->isExpanding.store(false, memory_order_release);
+			}
+			else
+			{
+				statsCache[id].expandCollision++;
+
+				if (node->childCount == 0)
+					return node; // first child is being expanded by another thread, sample this node again
+			}
+		}
 		else
-			node = BestChild(node, Cp);
+		{
+			int64_t startTime = GetTimeNs();
+			if (PreExpandTree(node, id))
+				child = ExpandTree(node, id);
+			statsCache[id].expandTime += GetTimeNs() - startTime;
+		}
+
+		if (child != NULL)
+		{
+			AddToPath(id, child);
+			return child;
+		}
+
+		if (node->state != GameBase::E_NORMAL)
+			break; // just proven by threat solver
+
+		child = BestChild(node, Cp);
+		if (child == NULL)
+		{
+			if (node->link != NODE_NULL)
+				continue; // just found to be a transposition
+
+			return node; // no space for children
+		}
+
+		node = child;
+		game.PutChess(node->move);
+		AddToPath(id, node);
 	}
+
+	game.state = node->state; // a proven node ends the playout like a finished game
 	return node;
 }
 
-bool MCTS::PreExpandTree(TreeNode *node)
+bool MCTS::PreExpandTree(TreeNode *node, int id)
 {
-	if (node->validGridCount > 0)
+	if (ENABLE_THREAT_SOLVER && !node->isThreatChecked && node->visit >= SOLVER_VISIT_THRESHOLD && node != trees[id % treeNum])
 	{
-		int id = rand() % node->validGridCount;
-		swap(node->validGrids[id], node->validGrids[node->validGridCount - 1]);
+		node->isThreatChecked = true;
+		if (SolveNode(node, id))
+			return false;
 	}
-	else
+
+	if (node->firstChild == NODE_NULL)
 	{
-		// try grids with lower priority after certain visits
-		if (ENABLE_TRY_MORE_NODE && node->gridLevel == 0 && node->visit > TRY_MORE_NODE_THRESHOLD * node->children.size())
+		if (ENABLE_TRANSPOSITION)
 		{
-			if (node->game->UpdateValidGridsExtra())
-			{
-				node->gridLevel++;
-				node->validGrids = node->game->validGrids;
-				node->validGridCount = node->game->validGridCount;
+			// share children with the node reached earlier by another move order
+			uint32_t nodeId = nodes->IndexOf(node);
+			// each tree has its own keys, so no node is shared between trees
+			uint64_t key = gameCache[id].board.hashKey + (id % treeNum) * 0x9E3779B97F4A7C15ull;
+			uint32_t owner = transTable.Insert(key, nodeId);
 
-				int id = rand() % node->validGridCount;
-				swap(node->validGrids[id], node->validGrids[node->validGridCount - 1]);
+			if (owner != nodeId)
+			{
+				statsCache[id].transHit++;
+				node->link.store(owner, memory_order_release);
+				return false;
 			}
+			statsCache[id].transMiss++;
 		}
+
+		if (!AllocateChildren(node, id))
+			return false;
 	}
-	return node->validGridCount > 0;
+
+	if (node->childCount >= node->childLimit)
+	{
+		// try grids with lower priority after certain visits
+		if (ENABLE_TRY_MORE_NODE && node->gridLevel == 0 && node->childLimit < node->childCapacity && node->visit > TRY_MORE_NODE_THRESHOLD * node->childCount)
+		{
+			node->gridLevel++;
+			node->childLimit = node->childCapacity;
+		}
+	}
+	return node->childCount < node->childLimit;
 }
 
-TreeNode* MCTS::ExpandTree(TreeNode *node)
+bool MCTS::AllocateChildren(TreeNode *node, int id)
 {
-	int move = node->validGrids[node->validGridCount - 1];
-	--(node->validGridCount);
+	GameBase &game = gameCache[id];
+	Random &random = randomCache[id];
+
+	// grids with lower priority are kept at the end of the block, see PreExpandTree
+	array<uint8_t, GRID_NUM> moves;
+	int count = game.validGridCount;
+	copy(game.validGrids.begin(), game.validGrids.begin() + count, moves.begin());
+
+	int extraCount = 0;
+	if (ENABLE_TRY_MORE_NODE && game.UpdateValidGridsExtra())
+	{
+		extraCount = game.validGridCount;
+		copy(game.validGrids.begin(), game.validGrids.begin() + extraCount, moves.begin() + count);
+	}
+
+	uint32_t firstChild = nodes->Allocate(count + extraCount);
+	if (firstChild == NODE_NULL)
+	{
+		statsCache[id].nodeAllocFail++;
+		return false;
+	}
+	statsCache[id].nodeCount += count + extraCount;
+
+	// children are expanded in random order
+	for (int i = count - 1; i > 0; --i)
+		swap(moves[i], moves[random.Next(i + 1)]);
 
-	TreeNode *newNode = NewTreeNode(node);
-	node->children.push_back(newNode);
-	*(newNode->game) = *(node->game);
-	newNode->game->PutChess(move);
-	newNode->validGridCount = newNode->game->validGridCount;
-	newNode->validGrids = newNode->game->validGrids;
+	for (int i = count + extraCount - 1; i > count; --i)
+		swap(moves[i], moves[count + random.Next(i - count + 1)]);
+
+	for (int i = 0; i < count + extraCount; ++i)
+	{
+		TreeNode &child = (*nodes)[firstChild + i];
+		child.move = moves[i];
+		child.side = 3 - node->side;
+	}
+
+	node->childLimit = count;
+	node->childCapacity = count + extraCount;
+	node->firstChild = firstChild;
+	return true;
+}
+
+TreeNode* MCTS::ExpandTree(TreeNode *node, int id)
+{
+	GameBase &game = gameCache[id];
+
+	TreeNode *newNode = GetChildren(node) + node->childCount;
+	game.PutChess(newNode->move);
+	newNode->state = game.state;
+
+	// publish the child only after it is fully built
+	node->childCount.store(node->childCount + 1, memory_order_release);
 
 	return newNode;
 }
 
 TreeNode* MCTS::BestChild(TreeNode *node, float c)
 {
-	TreeNode *result = NULL;
-	float bestScore = -1;
+	TreeNode *result = NULL, *loss = NULL;
+	float bestScore = -1, lossScore = -1;
 	float expandFactorParent_c = sqrtf(logf(node->visit)) * c;
 
-	for (auto child : node->children)
+	int childCount = node->childCount.load(memory_order_acquire);
+	if (childCount == 0)
+		return NULL;
+
+	TreeNode *children = GetChildren(node);
+	int win = (node->side == Board::E_BLACK) ? GameBase::E_BLACK_WIN : GameBase::E_WHITE_WIN;
+
+	for (int i = 0; i < childCount; ++i)
 	{
-		float score = CalcScoreFast(child, expandFactorParent_c);
+		int state = ENABLE_MCTS_SOLVER ? GetProvenState(&children[i]) : GameBase::E_NORMAL;
+		if (state == win)
+			return &children[i];
+
+		float score = CalcScoreFast(&children[i], expandFactorParent_c);
+		if (state != GameBase::E_NORMAL && state != GameBase::E_DRAW)
+		{
+			// proven losses are only chosen if there is nothing else
+			if (score > lossScore)
+			{
+				lossScore = score;
+				loss = &children[i];
+			}
+			continue;
+		}
+
 		if (score > bestScore)
 		{
 			bestScore = score;
-			result = child;
+			result = &children[i];
+		}
+	}
+	return (result != NULL) ? result : loss;
+}
+
+TreeNode* MCTS::MostVisitChild(TreeNode *node)
+{
+	TreeNode *result = NULL;
+	int mostVisit = -1;
+
+	int childCount = node->childCount.load(memory_order_acquire);
+	if (childCount == 0)
+		return NULL;
+
+	TreeNode *children = GetChildren(node);
+
+	for (int i = 0; i < childCount; ++i)
+	{
+		if (children[i].visit > mostVisit)
+		{
+			mostVisit = children[i].visit;
+			result = &children[i];
 		}
 	}
 	return result;
 }
 
+int MCTS::GetBestMoves(MoveInfo *result, int num)
+{
+	if (root == NULL || isPondering || root->childCount == 0)
+		return 0;
+
+	vector<TreeNode*> children;
+	TreeNode *first = GetChildren(root);
+	for (int i = 0; i < root->childCount; ++i)
+	{
+		if (first[i].visit > 0)
+			children.push_back(&first[i]);
+	}
+
+	num = min(num, (int)children.size());
+	partial_sort(children.begin(), children.begin() + num, children.end(), [](TreeNode *a, TreeNode *b)
+	{
+		return a->visit > b->visit;
+	});
+
+	for (int i = 0; i < num; ++i)
+	{
+		result[i].move = children[i]->move;
+		result[i].visit = children[i]->visit;
+		result[i].winRate = children[i]->value / children[i]->visit;
+	}
+	return num;
+}
+
+void MCTS::AddToPath(int id, TreeNode *node)
+{
+	SearchPath &path = pathCache[id];
+	path.nodes[path.length++] = node;
+
+	if (ENABLE_LOCK_FREE)
+		node->virtualLoss.fetch_add(VIRTUAL_LOSS, memory_order_relaxed);
+}
+
 float MCTS::CalcScore(const TreeNode *node, float c, float logParentVisit)
 {
 	float winRate = node->value / node->visit;
 	float expandFactor = c * sqrtf(logParentVisit / node->visit);
 
-	if (node->game->GetSide() == root->game->GetSide()) // win rate of opponent
+	if (node->side == searchSide) // win rate of opponent
 		winRate = 1 - winRate;
 
 	return winRate + expandFactor;
@@ -213,12 +1169,21 @@ float MCTS::CalcScore(const TreeNode *node, float c, float logParentVisit)
 
 float MCTS::CalcScoreFast(const TreeNode *node, float expandFactorParent_c)
 {
-	return node->winRate + node->expandFactor * expandFactorParent_c;
+	int virtualLoss = node->virtualLoss.load(memory_order_relaxed);
+	if (virtualLoss == 0)
+		return node->winRate + node->expandFactor * expandFactorParent_c;
+
+	// pending playouts of other threads count as losses for the side moving into this node
+	int visit = node->visit.load(memory_order_relaxed);
+	int visitAll = visit + virtualLoss;
+	float winRate = node->winRate * visit / visitAll;
+
+	return winRate + sqrtf(1.f / visitAll) * expandFactorParent_c;
 }
 
 float MCTS::DefaultPolicy(TreeNode *node, int id)
 {
-	gameCache[id] = *(node->game);
+	int startTurn = gameCache[id].turn;
 
 	float weight = 1.0f;
 	while (gameCache[id].state == GameBase::E_NORMAL)
@@ -226,171 +1191,292 @@ float MCTS::DefaultPolicy(TreeNode *node, int id)
 		float factor = (1 - FAST_STOP_BRANCH_FACTOR * gameCache[id].validGridCount);
 		weight *= max(factor, 0.5f);
 
-		int move = gameCache[id].GetNextMove();
+		int move = gameCache[id].GetNextMove(randomCache[id]);
 		gameCache[id].PutChess(move);
 
 		if (weight < FAST_STOP_THRESHOLD)
 		{
-			fastStopCount++;
-			fastStopSteps += gameCache[id].turn - node->game->turn;
+			statsCache[id].fastStopCount++;
+			statsCache[id].fastStopSteps += gameCache[id].turn - startTurn;
 
 			int betterSide = gameCache[id].CalcBetterSide();
 			gameCache[id].state = betterSide; // let better side win
 		}
 	}
-	float value = (gameCache[id].state == root->game->GetSide()) ? 1.f : 0;
+	int bucket = (gameCache[id].turn - startTurn) / ROLLOUT_HISTOGRAM_STEP;
+	statsCache[id].rolloutLength[min(bucket, ROLLOUT_HISTOGRAM_SIZE - 1)]++;
+
+	float value = (gameCache[id].state == searchSide) ? 1.f : 0;
 	value = (value - 0.5f) * weight + 0.5f;
 
 	return value;
 }
 
-void MCTS::UpdateValue(TreeNode *node, float value)
+void MCTS::UpdateValue(int id, float value)
 {
-	while (node != NULL)
+	SearchPath &path = pathCache[id];
+	bool isProven = ENABLE_MCTS_SOLVER && path.nodes[path.length - 1]->state != GameBase::E_NORMAL;
+
+	for (int i = path.length - 1; i >= 0; --i)
 	{
-		node->visit++;
-		node->value += value;
+		TreeNode *node = path.nodes[i];
 
-		node->expandFactor = sqrtf(1.f / node->visit);
-		node->winRate = node->value / node->visit;
+		if (isProven && i < path.length - 1)
+			isProven = UpdateProven(node, path.nodes[i + 1]);
 
-		if (node->game->GetSide() == root->game->GetSide()) // win rate of opponent
-			node->winRate = 1 - node->winRate;
+		int visit = node->visit.fetch_add(1, memory_order_relaxed) + 1;
+		AtomicAdd(node->value, value);
 
-		node = node->parent;
+		if (ENABLE_LOCK_FREE)
+			node->virtualLoss.fetch_sub(VIRTUAL_LOSS, memory_order_relaxed);
+
+		float winRate = node->value / visit;
+		if (node->side == searchSide) // win rate of opponent
+			winRate = 1 - winRate;
+
+		node->expandFactor = sqrtf(1.f / visit);
+		node->winRate = winRate;
 	}
 }
 
-void MCTS::ClearNodes(TreeNode *node)
+bool MCTS::UpdateProven(TreeNode *node, TreeNode *child)
 {
-	if (node != NULL)
+	if (node->state != GameBase::E_NORMAL)
+		return true;
+
+	if (node->link != NODE_NULL)
+	{
+		node->state = child->state.load(); // same position as the linked node
+		return true;
+	}
+
+	int win = (node->side == Board::E_BLACK) ? GameBase::E_BLACK_WIN : GameBase::E_WHITE_WIN;
+	if (child->state == win)
+	{
+		node->state = win;
+		return true;
+	}
+
+	// a loss or draw needs all children, including those not expanded yet
+	int childCount = node->childCount.load(memory_order_acquire);
+	if (node->firstChild == NODE_NULL || childCount < node->childCapacity)
+		return false;
+
+	int result = (win == GameBase::E_BLACK_WIN) ? GameBase::E_WHITE_WIN : GameBase::E_BLACK_WIN;
+	TreeNode *children = GetChildren(node);
+
+	for (int i = 0; i < childCount; ++i)
 	{
-		for (auto child : node->children)
+		int state = GetProvenState(&children[i]);
+		if (state == GameBase::E_NORMAL)
+			return false;
+
+		if (state == win)
 		{
-			ClearNodes(child);
+			result = win; // proven by another path
+			break;
 		}
 
-		RecycleTreeNode(node);
+		if (state == GameBase::E_DRAW)
+			result = GameBase::E_DRAW;
 	}
+
+	node->state = result;
+	return true;
 }
 
-TreeNode* MCTS::NewTreeNode(TreeNode *parent)
+int MCTS::GetProvenState(const TreeNode *node)
 {
-	if (pool.empty())
-	{
-		TreeNode *node = new TreeNode(parent);
-		node->game = new GameBase();
-		return node;
-	}
-
-	TreeNode *node = pool.back();
-	node->parent = parent;
-	pool.pop_back();
+	uint32_t link = node->link.load(memory_order_acquire);
+	if (link != NODE_NULL)
+		return (*nodes)[link].state;
 
-	return node;
+	return node->state;
 }
 
-void MCTS::RecycleTreeNode(TreeNode *node)
+TreeNode* MCTS::GetChildren(const TreeNode *node)
 {
-	node->parent = NULL;
-	node->visit = 0;
-	node->value = 0;
-	node->winRate = 0;
-	node->expandFactor = 0;
-	node->validGridCount = 0;
-	node->gridLevel = 0;
-	node->children.clear();
-
-	pool.push_back(node);
+	return &(*nodes)[node->firstChild];
 }
 
-void MCTS::ClearPool()
+void MCTS::WriteTreeLog()
 {
-	for (auto node : pool)
+	if (treeLog.level == TreeLogConfig::E_NONE)
+		return;
+
+	LogWriter &writer = LogWriter::Get();
+	vector<TreeLogNode> tree;
+	SnapshotTree(root, 0, false, tree);
+
+	// cleared by the first search that writes, so engines which do not log leave the file alone
+	writer.ClearOnce(treeLog.binary ? LOG_FILE_BINARY : LOG_FILE);
+
+	if (treeLog.binary)
 	{
-		delete node->game;
-		delete node;
+		writer.Write(LOG_FILE_BINARY, [turn = rootGame.turn, tree = move(tree)](FILE *fp)
+		{
+			DumpTree(fp, turn, tree);
+		});
+	}
+	else
+	{
+		writer.Write(LOG_FILE, [game = rootGame, tree = move(tree)](FILE *fp) mutable
+		{
+			game.board.Print(game.lastMove, fp);
+			game.board.PrintScore(3 - game.GetSide(), fp);
+			game.board.PrintScore(game.GetSide(), fp);
+			game.board.PrintPriority(fp);
+			PrintTree(fp, "PrintTree", tree);
+		});
 	}
-}
 
-void MCTS::PrintTree(TreeNode *node, int level)
-{
-	if (level == 1)
+	if (treeLog.level == TreeLogConfig::E_FULL)
 	{
-		freopen_s(&fp, LOG_FILE, "a+", stdout);
-		node->game->board.Print(node->game->lastMove, true);
-		node->game->board.PrintScore(3 - node->game->GetSide(), true);
-		node->game->board.PrintScore(node->game->GetSide(), true);
-		node->game->board.PrintPriority(true);
-		fclose(stdout);
-		freopen_s(&fp, "CON", "w", stdout);
+		vector<TreeLogNode> fullTree;
+		SnapshotTree(root, 0, true, fullTree);
+
+		// only the tree of last search is kept
+		const char *file = treeLog.binary ? LOG_FILE_FULL_BINARY : LOG_FILE_FULL;
+		writer.Clear(file);
 
-		fopen_s(&fp, LOG_FILE, "a+");
-		fprintf(fp, "===============================PrintTree=============================\n");
-		fprintf(fp, "visit: %d, value: %.1f, children: %d\n", node->visit, node->value, node->children.size());
+		if (treeLog.binary)
+		{
+			writer.Write(file, [turn = rootGame.turn, tree = move(fullTree)](FILE *fp)
+			{
+				vector<TreeLogNode> sortedTree;
+				SortTree(tree, 0, sortedTree);
+				DumpTree(fp, turn, sortedTree);
+			});
+		}
+		else
+		{
+			writer.Write(file, [tree = move(fullTree)](FILE *fp)
+			{
+				vector<TreeLogNode> sortedTree;
+				SortTree(tree, 0, sortedTree);
+				PrintTree(fp, "PrintFullTree", sortedTree);
+			});
+		}
 	}
-	
-	if (level > maxDepth)
-		maxDepth = level;
+}
 
-	node->children.sort([](const TreeNode *a, const TreeNode *b)
+void MCTS::SnapshotTree(TreeNode *node, int level, bool isFull, vector<TreeLogNode> &result)
+{
+	if (level == 0)
 	{
-		return a->visit > b->visit;
-	});
+		TreeLogNode rootNode = { 0, node->move, node->childCount, 0, node->visit, node->value, 0 };
+		result.push_back(rootNode);
+	}
 
-	int i = 1;
-	for (auto it = node->children.begin(); it != node->children.end(); ++it)
-	{
-		fprintf(fp, "%d", level);
-		for (int j = 0; j < level; ++j)
-			fprintf(fp, "   ");
+	if (treeLog.depth > 0 && level >= treeLog.depth)
+		return;
 
-		float expandFactorParent_c = sqrtf(logf(node->visit)) * Cp;
-		fprintf(fp, "visit: %d, value: %.1f, score: %.4f, children: %d, move: %s\n", (*it)->visit, (*it)->value, CalcScoreFast(*it, expandFactorParent_c), (*it)->children.size(), Game::Id2Str((*it)->game->lastMove).c_str());
-		PrintTree(*it, level + 1);
+	// the full tree is copied in arena order and sorted by the log thread, see SortTree
+	vector<TreeNode*> children;
+	for (int i = 0; i < node->childCount; ++i)
+		children.push_back(GetChildren(node) + i);
 
-		if (++i > 3)
-			break;
+	if (!isFull && children.size() > 3)
+	{
+		partial_sort(children.begin(), children.begin() + 3, children.end(), [](const TreeNode *a, const TreeNode *b)
+		{
+			return a->visit > b->visit;
+		});
+		children.resize(3);
+	}
+	else if (!isFull)
+	{
+		sort(children.begin(), children.end(), [](const TreeNode *a, const TreeNode *b)
+		{
+			return a->visit > b->visit;
+		});
 	}
 
-	if (level == 1)
+	float expandFactorParent_c = sqrtf(logf(node->visit)) * Cp;
+	for (TreeNode *child : children)
 	{
-		fprintf(fp,"================================TreeEnd============================\n\n");
-		fclose(fp);
+		TreeLogNode logNode = { (uint8_t)(level + 1), child->move, child->childCount, 0, child->visit, child->value, CalcScoreFast(child, expandFactorParent_c) };
+		result.push_back(logNode);
+
+		SnapshotTree(child, level + 1, isFull, result);
 	}
 }
 
-void MCTS::PrintFullTree(TreeNode *node, int level)
+size_t MCTS::SortTree(const vector<TreeLogNode> &tree, size_t index, vector<TreeLogNode> &result)
 {
-	if (level == 1)
+	result.push_back(tree[index]);
+
+	// subtree of each child is the range up to the next node on the same level or above
+	vector<pair<size_t, size_t>> children;
+	size_t i = index + 1;
+	while (i < tree.size() && tree[i].level > tree[index].level)
 	{
-		fopen_s(&fp, LOG_FILE_FULL, "w");
-		fprintf(fp, "===============================PrintFullTree=============================\n");
-		fprintf(fp, "visit: %d, value: %.1f, children: %d\n", node->visit, node->value, node->children.size());
+		size_t begin = i++;
+		while (i < tree.size() && tree[i].level > tree[begin].level)
+			++i;
+		children.push_back({ begin, i });
 	}
 
-	node->children.sort([](const TreeNode *a, const TreeNode *b)
+	stable_sort(children.begin(), children.end(), [&tree](const pair<size_t, size_t> &a, const pair<size_t, size_t> &b)
 	{
-		return a->visit > b->visit;
+		return tree[a.first].visit > tree[b.first].visit;
 	});
 
-	int i = 1;
-	for (auto it = node->children.begin(); it != node->children.end(); ++it)
+	for (auto &child : children)
+		SortTree(tree, child.first, result);
+
+	return i;
+}
+
+void MCTS::PrintTree(FILE *fp, const char *title, const vector<TreeLogNode> &tree)
+{
+	const TreeLogNode &root = tree[0];
+	fprintf(fp, "===============================%s=============================\n", title);
+	fprintf(fp, "visit: %d, value: %.1f, children: %d\n", root.visit, root.value, root.childCount);
+
+	for (size_t i = 1; i < tree.size(); ++i)
 	{
+		const TreeLogNode &node = tree[i];
+		int level = node.level;
+
 		fprintf(fp, "%d", level);
 		for (int j = 0; j < level; ++j)
 			fprintf(fp, "   ");
 
-		float expandFactorParent_c = sqrtf(logf(node->visit)) * Cp;
-		fprintf(fp, "visit: %d, value: %.1f, score: %.4f, children: %d, move: %s\n", (*it)->visit, (*it)->value, CalcScoreFast(*it, expandFactorParent_c), (*it)->children.size(), Game::Id2Str((*it)->game->lastMove).c_str());
-		PrintFullTree(*it, level + 1);
+		fprintf(fp, "visit: %d, value: %.1f, score: %.4f, children: %d, move: %s\n", node.visit, node.value, node.score, node.childCount, Game::Id2Str(node.move).c_str());
 	}
 
-	if (level == 1)
-	{
-		fprintf(fp, "================================TreeEnd============================\n\n");
-		fclose(fp);
-	}
+	fprintf(fp, "================================TreeEnd============================\n\n");
+}
+
+void MCTS::DumpTree(FILE *fp, int turn, const vector<TreeLogNode> &tree)
+{
+	TreeLogHeader header = { { 'G', 'B', 'T', 'L' }, 1, turn, (int32_t)tree.size() };
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(tree.data(), sizeof(TreeLogNode), tree.size(), fp);
+}
+
+int MCTS::CheckThreat(GameBase *state, int &vctMove)
+{
+	ThreatSolver &solver = solverCache[0];
+
+	int move = solver.Solve(*state, ThreatSolver::E_VCF, VCF_DEPTH, ROOT_SOLVER_NODE_LIMIT);
+	vctMove = (move == -1) ? solver.Solve(*state, ThreatSolver::E_VCT, VCT_DEPTH, ROOT_SOLVER_NODE_LIMIT) : -1;
+
+	return move;
+}
+
+bool MCTS::SolveNode(TreeNode *node, int id)
+{
+	statsCache[id].solverCount++;
+
+	if (solverCache[id].Solve(gameCache[id], ThreatSolver::E_VCF, VCF_DEPTH, TREE_SOLVER_NODE_LIMIT) == -1)
+		return false;
+
+	// the side to move wins, so the move into this node loses for the other side
+	statsCache[id].solverWin++;
+	node->state = (node->side == Board::E_BLACK) ? GameBase::E_BLACK_WIN : GameBase::E_WHITE_WIN;
+	return true;
 }
 
 int MCTS::CheckBook(GameBase *state)
@@ -402,9 +1488,9 @@ int MCTS::CheckBook(GameBase *state)
 
 	if (state->turn == 2 && Board::CalcDistance(state->lastMove, centerId) <= 3)
 	{
-		int id = state->GetNextMove();
+		int id = state->GetNextMove(random);
 		while (Board::CalcDistance(state->lastMove, id) > 1)
-			id = state->GetNextMove();
+			id = state->GetNextMove(random);
 
 		return id;
 	}
@@ -1,27 +1,192 @@
 #pragma once
 #include <list>
 #include <ctime>
+#include <chrono>
+#include <atomic>
+#include <mutex>
 #include "game.h"
+#include "threat.h"
+#include "pool.h"
 
 const int THREAD_NUM_MAX = 32;
+const uint32_t NODE_NULL = 0xffffffff;
+const int PATH_LENGTH_MAX = GRID_NUM * 2 + 1;
+const int ROLLOUT_HISTOGRAM_SIZE = 16;
+const int ROLLOUT_HISTOGRAM_STEP = 8; // moves per bucket, the last bucket counts all longer rollouts
 
 class TreeNode
 {
 public:
-	TreeNode(TreeNode *p);
+	TreeNode();
+	void CopyStats(const TreeNode &node);
+
+	atomic<int> visit;
+	atomic<float> value;
+	atomic<float> winRate;
+	atomic<float> expandFactor;
+	atomic<int> virtualLoss;
+	atomic<bool> isExpanding; // claimed by the thread expanding this node
+
+	// the position is not stored, it is rebuilt by replaying moves from root
+	uint8_t move;
+	char side; // side to move in this node
+	atomic<char> state; // result of the game, also set when it is proven by threat solver or by children
+	uint8_t gridLevel;
+	bool isThreatChecked;
+
+	// a transposed node has no children, search continues from the node it links to
+	atomic<uint32_t> link;
+
+	// all children are allocated as one block when the node is first expanded, then activated one by one
+	uint32_t firstChild;
+	atomic<uint8_t> childCount;
+	uint8_t childLimit; // children available in current grid level
+	uint8_t childCapacity;
+};
+
+class NodeArena
+{
+public:
+	NodeArena();
+	~NodeArena();
+
+	uint32_t Allocate(int count);
+	void Reset() { top = 0; }
+	void SetCapacity(uint32_t num); // at most NODE_ARENA_SIZE, the arena is allocated again and its nodes are dropped
+	uint32_t GetCapacity() { return capacity; }
+	bool IsFull() { return top + GRID_NUM > capacity; } // a block of children may not fit any more
+	size_t Size() { return top; }
+
+	TreeNode& operator[](uint32_t index) { return nodes[index]; }
+	uint32_t IndexOf(const TreeNode *node) { return node - nodes; }
+
+private:
+	TreeNode *nodes;
+	atomic<uint32_t> top;
+	uint32_t capacity;
+};
+
+// maps position hash to the first node expanded with that position, shared by all search threads
+class TransTable
+{
+public:
+	TransTable();
+	~TransTable();
+
+	uint32_t Insert(uint64_t key, uint32_t node);
 	void Clear();
+	size_t MemorySize() { return sizeof(Entry) * (mask + 1); }
+
+private:
+	struct Entry
+	{
+		atomic<uint64_t> key;
+		atomic<uint32_t> node;
+	};
 
+	Entry *table;
+	uint32_t mask;
+};
+
+// child of root after search, for analysis
+struct MoveInfo
+{
+	int move;
 	int visit;
+	float winRate; // for the side to move at root
+};
+
+// time limits in milliseconds, 0 means no limit
+struct TimeBudget
+{
+	TimeBudget(int moveTime = 0, int totalTime = 0, int increment = 0) : moveTime(moveTime), totalTime(totalTime), increment(increment), reserve(50) {}
+
+	int moveTime; // hard limit for this move
+	int totalTime; // time left for the rest of the game
+	int increment; // time added after each move
+	int reserve; // taken from the limits for sending the move, at most a tenth of each, 0 for a time slice of a longer search
+};
+
+// nodes one thread visited from root, used for back propagation
+// written at every tree step, so each thread has its own cache lines
+struct alignas(64) SearchPath
+{
+	int length;
+	array<TreeNode*, PATH_LENGTH_MAX> nodes;
+};
+
+// generator of one thread, its state is written at every rollout move, so it takes a cache line of its own
+struct alignas(64) ThreadRandom : public Random
+{
+};
+
+// counters of one search, each thread counts its own and they are merged when search ends
+struct alignas(64) SearchStats
+{
+	SearchStats() { Clear(); }
+	void Clear();
+	void Merge(const SearchStats &stats);
+
+	int threadNum;
+	int iterations;
+	int maxDepth; // moves from root to the deepest leaf
+	float time; // in seconds
+
+	// time of each phase in nanoseconds, summed over threads
+	int64_t selectTime;
+	int64_t expandTime;
+	int64_t rolloutTime;
+	int64_t updateTime;
+	int64_t lockWaitTime; // only without lock free search
+	array<int64_t, THREAD_NUM_MAX> threadLockWaitTime;
+
+	int nodeCount; // nodes allocated
+	int nodeAllocFail; // arena is full
+	int transHit; // node found in transposition table
+	int transMiss;
+	int expandCollision; // node is being expanded by another thread
+	int solverCount; // tree nodes checked by threat solver
+	int solverWin; // tree nodes proven to be won by the side to move
+
+	int fastStopCount;
+	int fastStopSteps;
+	array<int, ROLLOUT_HISTOGRAM_SIZE> rolloutLength;
+};
+
+// node of a search tree snapshot, nodes are in depth first order and the parent of a node is the last one a level up
+struct TreeLogNode
+{
+	uint8_t level; // 0 for root
+	uint8_t move;
+	uint8_t childCount;
+	uint8_t reserved;
+	int32_t visit;
 	float value;
-	float winRate;
-	float expandFactor;
-	int validGridCount;
-	int gridLevel;
-	GameBase *game;
-
-	TreeNode *parent;
-	list<TreeNode*> children;
-	array<uint8_t, GRID_NUM> validGrids;
+	float score;
+};
+
+// binary tree log is a TreeLogHeader followed by nodeCount TreeLogNode records for each search
+struct TreeLogHeader
+{
+	char magic[4]; // "GBTL"
+	int32_t version;
+	int32_t turn; // turn of root position
+	int32_t nodeCount;
+};
+
+// search tree written to log after each search
+struct TreeLogConfig
+{
+	enum Level
+	{
+		E_NONE,
+		E_BEST, // 3 most visited children of each node
+		E_FULL, // whole tree to another file as well
+	};
+
+	int level = E_BEST;
+	int depth = 0; // levels below root, 0 means no limit
+	bool binary = false; // TreeLogNode records instead of text
 };
 
 class MCTS
@@ -30,35 +195,115 @@ public:
 	MCTS(int mode = 0);
 	~MCTS();
 	int Search(Game *state);
+	int Search(Game *state, const TimeBudget &budget, SearchStats *stats = NULL);
+	void SetSeed(uint64_t seed) { random.Seed(seed); }
+	void SetThreadNum(int num) { threadNumLimit = num; } // 0 means one thread per hardware thread
+	void SetTreeNum(int num) { treeNumLimit = num; } // independent trees the threads are split between, 1 means one shared tree
+	void SetTreeLog(const TreeLogConfig &config) { treeLog = config; }
+	void SetThreadAffinity(bool enable) { pool.SetAffinity(enable); } // pin search threads to cpus
+	void SetMemoryLimit(size_t bytes); // limits the tree size, 0 means the full arena, a new size drops the tree
+	void SetVerbose(bool enable) { verbose = enable; } // print search info to stdout
+	int GetBestMoves(MoveInfo *result, int num); // most visited moves of last search, returns how many are written
+
+	// keep searching the tree in background after Search returns, until the next Search or StopPonder
+	void SetPonder(bool enable) { enablePonder = enable; }
+	void StopPonder();
 
 private:
-	static void SearchThread(int id, int seed, MCTS *mcts, clock_t startTime);
+	friend class Benchmark;
+
+	static void SearchThread(int id, MCTS *mcts);
+	int GetThreadNum();
+	void InitThreads();
+	void StartThreads();
+	void RunThreads(); // search until stop
+	void JoinThreads();
+	void StartPonder(TreeNode *node);
+
+	// root parallel search, stats of root and its children are merged between trees from time to time
+	void InitTrees();
+	void SyncTrees();
+	void ExpandTreeMoves(); // root children searched by any tree are added to tree 0, only when threads are stopped
+	TreeNode* ExpandRootMove(int move); // the child of root for the move, expanded if needed, only when threads are stopped
+	void SetNodeStats(TreeNode *node, int visit, float value);
+
+	// time control
+	void InitTimeControl(const TimeBudget &budget);
+	bool CheckStop(int iteration);
+	float GetElapsedTime();
 
 	// standard MCTS process
-	TreeNode* TreePolicy(TreeNode *node);
-	TreeNode* ExpandTree(TreeNode *node);
+	TreeNode* TreePolicy(TreeNode *node, int id);
+	TreeNode* ExpandTree(TreeNode *node, int id);
 	TreeNode* BestChild(TreeNode *node, float c);
 	float DefaultPolicy(TreeNode *node, int id);
-	void UpdateValue(TreeNode *node, float value);
+	void UpdateValue(int id, float value);
 
 	// custom optimization
-	bool PreExpandTree(TreeNode *node);
+	bool PreExpandTree(TreeNode *node, int id);
+	bool AllocateChildren(TreeNode *node, int id);
+
+	// proven results, a node is a win for its side to move if one child is, and a loss if all children are
+	bool UpdateProven(TreeNode *node, TreeNode *child);
+	int GetProvenState(const TreeNode *node);
+
+	// lock free search
+	TreeNode* MostVisitChild(TreeNode *node);
+	void AddToPath(int id, TreeNode *node);
 
 	int CheckBook(GameBase *state);
+	int CheckThreat(GameBase *state, int &vctMove); // returns a VCF win, a VCT move is only a hint for the search
+	bool SolveNode(TreeNode *node, int id);
+
+	// tree reuse between searches
+	void ReuseTree(Game *state);
+	TreeNode* FindChild(TreeNode *node, int move);
+	void CopyTree(TreeNode *node, NodeArena &target, uint32_t targetId);
 
-	void ClearNodes(TreeNode *node);
 	float CalcScore(const TreeNode *node, float c, float logParentVisit);
 	float CalcScoreFast(const TreeNode *node, float expandFactorParent_c);
-	void PrintTree(TreeNode *node, int level = 1);
-	void PrintFullTree(TreeNode *node, int level = 1);
-
-	TreeNode* NewTreeNode(TreeNode *parent);
-	void RecycleTreeNode(TreeNode *node);
-	void ClearPool();
-	
-	int maxDepth, fastStopSteps, fastStopCount;
-	GameBase gameCache[THREAD_NUM_MAX];
-	list<TreeNode*> pool;
+
+	// tree log, snapshots are taken after search and written by the log thread
+	void WriteTreeLog();
+	void SnapshotTree(TreeNode *node, int level, bool isFull, vector<TreeLogNode> &result);
+	static size_t SortTree(const vector<TreeLogNode> &tree, size_t index, vector<TreeLogNode> &result); // children by visit, returns end of subtree
+	static void PrintTree(FILE *fp, const char *title, const vector<TreeLogNode> &tree);
+	static void DumpTree(FILE *fp, int turn, const vector<TreeLogNode> &tree);
+
+	TreeNode* GetChildren(const TreeNode *node);
+
+	int threadNum, threadNumLimit;
+	int treeNum, treeNumLimit;
+	array<TreeNode*, THREAD_NUM_MAX> trees; // root of each tree, thread id searches tree id % treeNum, trees[0] is root
+	float lastSyncTime;
+	// slot GRID_NUM is the root, other slots are root children by move
+	array<int, GRID_NUM + 1> syncVisit[THREAD_NUM_MAX]; // stats written to each tree by last sync
+	array<float, GRID_NUM + 1> syncValue[THREAD_NUM_MAX];
+	array<int, GRID_NUM + 1> totalVisit; // merged stats
+	array<float, GRID_NUM + 1> totalValue;
+	WorkerPool pool; // search threads, kept between searches and used by ponder as well
+	bool enablePonder;
+	bool isPondering; // search threads are running after Search has returned
+	chrono::steady_clock::time_point startTime;
+	float optimumTime, maximumTime; // in seconds
+	int startVisit;
+	atomic<bool> stopSearch;
+	GameBase gameCache[THREAD_NUM_MAX]; // position of the node each thread is visiting
+	SearchPath pathCache[THREAD_NUM_MAX];
+	ThreadRandom randomCache[THREAD_NUM_MAX]; // seeded from master random before each search
+	SearchStats statsCache[THREAD_NUM_MAX];
+	ThreatSolver solverCache[THREAD_NUM_MAX];
+	Random random;
+	GameBase rootGame;
+	int searchSide;
+	NodeArena arena[2]; // the tree lives in one arena, the other one receives the reused subtree
+	NodeArena *nodes;
+	TransTable transTable;
 	TreeNode *root;
+	vector<uint8_t> rootRecord;
+	vector<uint8_t> noThreatRecord; // last position where root threat solver found no VCF
 	int mode;
+	TreeLogConfig treeLog;
+	bool verbose;
+	mutex treeMutex; // guards the tree without lock free search
 };
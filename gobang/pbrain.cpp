@@ -0,0 +1,278 @@
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <cstdarg>
+#include <string>
+#include <vector>
+#include "game.h"
+#include "mcts.h"
+
+// Gomocup (Piskvork) protocol brain, commands come from stdin and every answer is one line on stdout
+// nothing else may be written to stdout, so the engine is silent and no log file is written
+
+const int DEFAULT_TURN_TIME = 30000; // in milliseconds, until the manager sends INFO timeout_turn
+const int RULE_RENJU = 4; // bit of INFO rule
+
+class Brain
+{
+public:
+	Brain();
+	void Run();
+
+private:
+	bool HandleLine(char *line); // false on END
+	void HandleInfo(const char *key, const char *value);
+	void HandleBoard();
+	void Think();
+
+	static bool ParseMove(const char *text, int &id, int *field = NULL);
+	static void Send(const char *format, ...);
+
+	MCTS ai;
+	Game game;
+	bool isStarted;
+
+	int turnTime; // INFO timeout_turn
+	int matchTime; // INFO timeout_match, 0 means no limit
+	int timeLeft; // INFO time_left
+};
+
+Brain::Brain()
+{
+	isStarted = false;
+	turnTime = DEFAULT_TURN_TIME;
+	matchTime = 0;
+	timeLeft = 0;
+
+	ai.SetVerbose(false);
+	TreeLogConfig treeLog;
+	treeLog.level = TreeLogConfig::E_NONE;
+	ai.SetTreeLog(treeLog);
+	game.SetLogLevel(Game::E_LOG_NONE);
+}
+
+void Brain::Run()
+{
+	char line[256];
+	while (fgets(line, sizeof(line), stdin) != NULL)
+	{
+		if (!HandleLine(line))
+			break;
+	}
+}
+
+bool Brain::HandleLine(char *line)
+{
+	// the manager may send \r\n
+	line[strcspn(line, "\r\n")] = 0;
+
+	char *command = strtok(line, " \t");
+	if (command == NULL)
+		return true;
+
+	for (char *c = command; *c; ++c)
+		*c = toupper(*c);
+
+	char *args = strtok(NULL, "");
+	if (args == NULL)
+		args = (char*)"";
+
+	if (strcmp(command, "START") == 0)
+	{
+		if (atoi(args) != BOARD_SIZE)
+		{
+			Send("ERROR only board size %d is supported", BOARD_SIZE);
+			return true;
+		}
+
+		game.Reset();
+		isStarted = true;
+		Send("OK");
+	}
+	else if (strcmp(command, "RESTART") == 0)
+	{
+		game.Reset();
+		Send("OK");
+	}
+	else if (strcmp(command, "END") == 0)
+	{
+		return false;
+	}
+	else if (strcmp(command, "ABOUT") == 0)
+	{
+		Send("name=\"gobang\", version=\"1.0\"");
+	}
+	else if (strcmp(command, "INFO") == 0)
+	{
+		char *key = strtok(args, " \t");
+		char *value = strtok(NULL, " \t");
+		if (key != NULL && value != NULL)
+			HandleInfo(key, value);
+	}
+	else if (!isStarted)
+	{
+		Send("ERROR START is expected first");
+	}
+	else if (strcmp(command, "BEGIN") == 0)
+	{
+		Think();
+	}
+	else if (strcmp(command, "TURN") == 0)
+	{
+		int id;
+		if (!ParseMove(args, id) || !game.PutChess(id))
+		{
+			Send("ERROR invalid move %s", args);
+			return true;
+		}
+		Think();
+	}
+	else if (strcmp(command, "BOARD") == 0)
+	{
+		HandleBoard();
+	}
+	else if (strcmp(command, "TAKEBACK") == 0)
+	{
+		int id;
+		const vector<uint8_t> &record = game.GetRecord();
+		if (!ParseMove(args, id) || record.empty() || record.back() != id)
+		{
+			Send("ERROR invalid takeback %s", args);
+			return true;
+		}
+
+		game.Regret(1);
+		Send("OK");
+	}
+	else
+	{
+		Send("UNKNOWN %s", command);
+	}
+	return true;
+}
+
+void Brain::HandleInfo(const char *key, const char *value)
+{
+	if (strcmp(key, "timeout_turn") == 0)
+	{
+		turnTime = atoi(value);
+	}
+	else if (strcmp(key, "timeout_match") == 0)
+	{
+		matchTime = atoi(value);
+	}
+	else if (strcmp(key, "time_left") == 0)
+	{
+		timeLeft = atoi(value);
+	}
+	else if (strcmp(key, "max_memory") == 0)
+	{
+		ai.SetMemoryLimit(strtoull(value, NULL, 10));
+	}
+	else if (strcmp(key, "thread_num") == 0)
+	{
+		ai.SetThreadNum(max(atoi(value), 0)); // not in every manager, without it there is one thread per hardware thread
+	}
+	else if (strcmp(key, "rule") == 0)
+	{
+		bool isRenju = (atoi(value) & RULE_RENJU) != 0;
+		if (isRenju != (RESTRICTED_MOVE_RULE != 0))
+			Send("MESSAGE rule %s is not the rule of this build, use gobang_pbrain%s", value, isRenju ? "_restrict" : "");
+	}
+}
+
+void Brain::HandleBoard()
+{
+	// stones are given by owner, they are replayed black and white in turn keeping the order of each side
+	vector<int> stones[2]; // own, opponent
+	bool isValid = true;
+
+	char line[256];
+	while (fgets(line, sizeof(line), stdin) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		if (strncmp(line, "DONE", 4) == 0)
+			break;
+
+		int id, field;
+		if (!ParseMove(line, id, &field) || field < 1 || field > 3)
+			isValid = false;
+		else
+			stones[field == 1 ? 0 : 1].push_back(id); // 3 is a stone of the opponent in continuous game
+	}
+
+	// black moves first, so the side to move is black if both have the same number of stones
+	int ownNum = stones[0].size(), otherNum = stones[1].size();
+	if (ownNum != otherNum && ownNum + 1 != otherNum)
+		isValid = false;
+
+	const vector<int> &black = (ownNum == otherNum) ? stones[0] : stones[1];
+	const vector<int> &white = (ownNum == otherNum) ? stones[1] : stones[0];
+
+	game.Reset();
+	for (int i = 0; isValid && i < black.size(); ++i)
+	{
+		if (!game.PutChess(black[i]) || (i < white.size() && !game.PutChess(white[i])))
+			isValid = false;
+	}
+
+	if (!isValid)
+	{
+		game.Reset();
+		Send("ERROR invalid board");
+		return;
+	}
+	Think();
+}
+
+void Brain::Think()
+{
+	if (game.GetState() != GameBase::E_NORMAL)
+	{
+		Send("ERROR game is over");
+		return;
+	}
+
+	TimeBudget budget(max(turnTime, 1));
+	if (matchTime > 0)
+		budget.totalTime = max(timeLeft > 0 ? timeLeft : matchTime, 1);
+
+	int id = ai.Search(&game, budget);
+	game.PutChess(id);
+
+	int row, col;
+	Board::Id2Coord(id, row, col);
+	Send("%d,%d", col, row);
+}
+
+bool Brain::ParseMove(const char *text, int &id, int *field)
+{
+	int x, y, value;
+	int count = sscanf(text, "%d,%d,%d", &x, &y, &value);
+	if (count < 2 || (field != NULL && count < 3) || !Board::IsValidCoord(y, x))
+		return false;
+
+	if (field != NULL)
+		*field = value;
+
+	id = Board::Coord2Id(y, x);
+	return true;
+}
+
+void Brain::Send(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(stdout, format, args);
+	va_end(args);
+
+	fputc('\n', stdout);
+	fflush(stdout);
+}
+
+int main()
+{
+	Brain brain;
+	brain.Run();
+	return 0;
+}
@@ -0,0 +1,189 @@
+#include <cstdio>
+#include <cstdint>
+#include "pool.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+WorkerPool::WorkerPool()
+{
+	jobThreadNum = 0;
+	runningNum = 0;
+	generation = 0;
+	enableAffinity = false;
+	stop = false;
+}
+
+WorkerPool::~WorkerPool()
+{
+	Wait();
+
+	{
+		lock_guard<mutex> lock(mtx);
+		stop = true;
+	}
+	hasJob.notify_all();
+
+	for (auto &worker : workers)
+		worker.join();
+}
+
+void WorkerPool::Run(int threadNum, function<void(int id)> job)
+{
+	{
+		lock_guard<mutex> lock(mtx);
+
+		// new workers skip jobs started before them
+		while ((int)workers.size() < threadNum)
+			workers.emplace_back(&WorkerPool::WorkerThread, this, (int)workers.size(), generation);
+
+		this->job = move(job);
+		jobThreadNum = threadNum;
+		runningNum = threadNum;
+		++generation;
+	}
+	hasJob.notify_all();
+}
+
+void WorkerPool::Wait()
+{
+	unique_lock<mutex> lock(mtx);
+	isIdle.wait(lock, [this] { return runningNum == 0; });
+}
+
+bool WorkerPool::IsRunning()
+{
+	lock_guard<mutex> lock(mtx);
+	return runningNum > 0;
+}
+
+void WorkerPool::WorkerThread(int id, uint64_t generation)
+{
+	bool isPinned = false;
+	unique_lock<mutex> lock(mtx);
+
+	while (true)
+	{
+		hasJob.wait(lock, [&] { return stop || this->generation != generation; });
+		if (stop)
+			break;
+
+		generation = this->generation;
+		if (id >= jobThreadNum)
+			continue;
+
+		bool pin = enableAffinity;
+		lock.unlock();
+
+		if (pin != isPinned)
+		{
+			ApplyAffinity(id, pin);
+			isPinned = pin;
+		}
+
+		job(id);
+
+		lock.lock();
+		if (--runningNum == 0)
+			isIdle.notify_all();
+	}
+}
+
+#ifdef __linux__
+
+void WorkerPool::ApplyAffinity(int id, bool enable)
+{
+	const vector<int> &cpus = GetCpuOrder();
+	if (cpus.empty())
+		return;
+
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	if (enable)
+	{
+		CPU_SET(cpus[id % cpus.size()], &cpuSet);
+	}
+	else
+	{
+		for (int cpu : cpus)
+			CPU_SET(cpu, &cpuSet);
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+}
+
+const vector<int>& WorkerPool::GetCpuOrder()
+{
+	static const vector<int> cpus = []
+	{
+		vector<int> result;
+
+		// cpus the calling worker may run on, it is not pinned yet when this is first called
+		cpu_set_t allowed;
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+			return result;
+
+		// cpus of node 0 first, then node 1 and so on, a cpu list is like "0-3,8-11"
+		vector<bool> isAdded(CPU_SETSIZE, false);
+		for (int node = 0; ; ++node)
+		{
+			char path[64];
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+			FILE *fp = fopen(path, "r");
+			if (fp == NULL)
+				break;
+
+			int first, last;
+			while (fscanf(fp, "%d", &first) == 1)
+			{
+				last = first;
+				int c = fgetc(fp);
+				if (c == '-')
+				{
+					if (fscanf(fp, "%d", &last) != 1)
+						break;
+					c = fgetc(fp);
+				}
+
+				for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+				{
+					if (CPU_ISSET(cpu, &allowed) && !isAdded[cpu])
+					{
+						result.push_back(cpu);
+						isAdded[cpu] = true;
+					}
+				}
+
+				if (c != ',')
+					break;
+			}
+			fclose(fp);
+		}
+
+		// no NUMA information, or cpus missing from it
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &allowed) && !isAdded[cpu])
+				result.push_back(cpu);
+		}
+		return result;
+	}();
+
+	return cpus;
+}
+
+#else
+
+void WorkerPool::ApplyAffinity(int id, bool enable)
+{
+	// pinning is only supported on linux
+}
+
+const vector<int>& WorkerPool::GetCpuOrder()
+{
+	static const vector<int> cpus;
+	return cpus;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+// long lived worker threads, so a search does not pay for creating threads and warming their caches every move
+// one job runs at a time on the first threadNum workers, each worker gets its id and workers are created when first needed
+class WorkerPool
+{
+public:
+	WorkerPool();
+	~WorkerPool();
+
+	void Run(int threadNum, function<void(int id)> job); // returns once the job is started, call Wait before the next one
+	void Wait();
+	bool IsRunning();
+	int GetSize() { return (int)workers.size(); }
+
+	// pin worker i to the i-th allowed cpu, cpus are ordered by NUMA node so a small search stays on one node
+	void SetAffinity(bool enable) { enableAffinity = enable; }
+
+private:
+	void WorkerThread(int id, uint64_t generation);
+	void ApplyAffinity(int id, bool enable);
+
+	static const vector<int>& GetCpuOrder();
+
+	vector<thread> workers;
+	function<void(int id)> job;
+	int jobThreadNum;
+	int runningNum; // workers still running the job
+	uint64_t generation; // increased for every job, workers wait for a new one
+	bool enableAffinity;
+	bool stop;
+	mutex mtx;
+	condition_variable hasJob;
+	condition_variable isIdle;
+};
@@ -0,0 +1,443 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <atomic>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "game.h"
+#include "mcts.h"
+#include "pool.h"
+
+// analysis server, every connection is one game with its own engine and tree
+// searches of all games are cut into time slices run by one shared pool, see Scheduler::RunnerThread for the order
+//
+// commands, one per line:
+//   position [moves]    new game from the moves, like "position H8 I9", answers "ok"
+//   play move           one more move, answers "ok"
+//   go ms               search and play the best move within ms milliseconds, answers "move H8"
+//   analyze ms [n]      search without playing, answers n lines like "info H8 visit 100 win 0.53" and then "bestmove H8"
+//   quit
+// errors are answered by "error" and a reason
+
+using Clock = chrono::steady_clock;
+
+const int SLICE_TIME = 50; // search time of one slice in milliseconds
+const int DEADLINE_RESERVE = 10; // the answer is sent this long before the deadline
+const int ANALYZE_MOVE_NUM = 5;
+const int ANALYZE_MOVE_MAX = 32;
+const int SESSION_MEMORY = 128; // in MB, without a limit every game reserves the address space of two full arenas
+
+struct ServerConfig
+{
+	const char *socketPath = "gobang.sock";
+	int port = 0; // TCP on loopback instead of the unix socket
+	int threadNum = 0; // 0 means one per hardware thread
+	int sliceTime = SLICE_TIME;
+	int memory = SESSION_MEMORY; // memory of each game in MB, 0 means no limit
+};
+
+class Session
+{
+public:
+	Session(int fd, const ServerConfig &config);
+
+	void Send(const string &text);
+	void Close();
+	bool IsClosed();
+
+	Game game;
+	MCTS ai;
+	atomic<bool> isBusy; // a request of this game is queued or running, the game is not changed meanwhile
+
+private:
+	int fd;
+	bool isClosed;
+	mutex writeMutex;
+};
+
+struct Request
+{
+	shared_ptr<Session> session;
+	bool isAnalyze;
+	int moveNum;
+	int searchTime; // in milliseconds
+	int usedTime; // slices already given
+	Clock::time_point deadline;
+	int bestMove;
+};
+
+class Scheduler
+{
+public:
+	Scheduler(const ServerConfig &config);
+	~Scheduler();
+
+	void Post(Request request);
+
+private:
+	void RunnerThread();
+	bool RunSlice(Request &request); // true if the request is finished
+	void Finish(Request &request);
+
+	WorkerPool pool;
+	deque<Request> requests;
+	mutex mtx;
+	condition_variable hasRequest;
+	bool stop;
+	int sliceTime;
+};
+
+Session::Session(int fd, const ServerConfig &config) : fd(fd)
+{
+	isBusy = false;
+	isClosed = false;
+
+	game.SetLogLevel(Game::E_LOG_NONE);
+
+	// the scheduler gives threads to games, one search never uses more than one
+	ai.SetThreadNum(1);
+	ai.SetVerbose(false);
+	ai.SetMemoryLimit((size_t)config.memory << 20);
+	TreeLogConfig treeLog;
+	treeLog.level = TreeLogConfig::E_NONE;
+	ai.SetTreeLog(treeLog);
+}
+
+void Session::Send(const string &text)
+{
+	lock_guard<mutex> lock(writeMutex);
+	if (isClosed)
+		return;
+
+	string line = text + "\n";
+	for (size_t sent = 0; sent < line.size(); )
+	{
+		ssize_t n = send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+		sent += n;
+	}
+}
+
+void Session::Close()
+{
+	// closed under the lock, so a runner never writes to a descriptor reused by another connection
+	lock_guard<mutex> lock(writeMutex);
+	isClosed = true;
+	close(fd);
+}
+
+bool Session::IsClosed()
+{
+	lock_guard<mutex> lock(writeMutex);
+	return isClosed;
+}
+
+Scheduler::Scheduler(const ServerConfig &config)
+{
+	stop = false;
+	sliceTime = config.sliceTime;
+
+	int threadNum = (config.threadNum > 0) ? config.threadNum : thread::hardware_concurrency();
+	threadNum = max(threadNum, 1);
+	pool.Run(threadNum, [this](int id) { RunnerThread(); });
+	printf("%d search threads, %d ms slices\n", threadNum, sliceTime);
+}
+
+Scheduler::~Scheduler()
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		stop = true;
+	}
+	hasRequest.notify_all();
+	pool.Wait();
+}
+
+void Scheduler::Post(Request request)
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		requests.push_back(move(request));
+	}
+	hasRequest.notify_one();
+}
+
+void Scheduler::RunnerThread()
+{
+	unique_lock<mutex> lock(mtx);
+
+	while (true)
+	{
+		hasRequest.wait(lock, [this] { return stop || !requests.empty(); });
+		if (stop)
+			break;
+
+		// the request given the least time goes next, so games share the threads evenly,
+		// but a request that would miss its deadline by waiting for another slice goes first
+		Clock::time_point urgentTime = Clock::now() + chrono::milliseconds(sliceTime + DEADLINE_RESERVE);
+		auto next = requests.begin();
+		for (auto it = requests.begin(); it != requests.end(); ++it)
+		{
+			bool isUrgent = it->deadline < urgentTime;
+			bool isNextUrgent = next->deadline < urgentTime;
+			if (isUrgent != isNextUrgent ? isUrgent : isUrgent ? it->deadline < next->deadline : it->usedTime < next->usedTime)
+				next = it;
+		}
+
+		Request request = move(*next);
+		requests.erase(next);
+		lock.unlock();
+
+		bool isFinished = RunSlice(request);
+
+		lock.lock();
+		if (!isFinished)
+		{
+			requests.push_back(move(request));
+			hasRequest.notify_one();
+		}
+	}
+}
+
+bool Scheduler::RunSlice(Request &request)
+{
+	if (request.session->IsClosed())
+		return true; // nobody waits for the answer
+
+	int timeLeft = request.searchTime - request.usedTime;
+	int deadlineLeft = (int)chrono::duration_cast<chrono::milliseconds>(request.deadline - Clock::now()).count() - DEADLINE_RESERVE;
+	int slice = min(sliceTime, min(timeLeft, deadlineLeft));
+
+	if (slice <= 0 && request.bestMove != -1)
+	{
+		Finish(request);
+		return true;
+	}
+
+	// a request always gets one slice, so there is a move to answer
+	TimeBudget budget(max(slice, 1));
+	budget.reserve = 0;
+
+	SearchStats stats;
+	Session &session = *request.session;
+	request.bestMove = session.ai.Search(&session.game, budget, &stats);
+	request.usedTime += max(slice, 1); // the whole slice is charged, it may end early when the best move is clear
+
+	// book moves and wins found by the threat solver come without a search
+	if (stats.threadNum == 0 || request.usedTime >= request.searchTime)
+	{
+		Finish(request);
+		return true;
+	}
+	return false;
+}
+
+void Scheduler::Finish(Request &request)
+{
+	Session &session = *request.session;
+	string move = Game::Id2Str(request.bestMove);
+	vector<string> answer;
+
+	if (request.isAnalyze)
+	{
+		MoveInfo moves[ANALYZE_MOVE_MAX];
+		int num = session.ai.GetBestMoves(moves, request.moveNum);
+
+		for (int i = 0; i < num; ++i)
+		{
+			char line[64];
+			snprintf(line, sizeof(line), "info %s visit %d win %.3f", Game::Id2Str(moves[i].move).c_str(), moves[i].visit, moves[i].winRate);
+			answer.push_back(line);
+		}
+		answer.push_back("bestmove " + move);
+	}
+	else
+	{
+		session.game.PutChess(request.bestMove);
+		answer.push_back("move " + move);
+	}
+
+	// the client may send the next command as soon as it reads the answer
+	session.isBusy = false;
+	for (auto &line : answer)
+		session.Send(line);
+}
+
+// one thread for each connection, it reads commands and posts searches to the scheduler
+void ConnectionThread(shared_ptr<Session> session, int fd, Scheduler *scheduler)
+{
+	string buffer;
+	char data[1024];
+
+	while (true)
+	{
+		ssize_t n = recv(fd, data, sizeof(data), 0);
+		if (n <= 0)
+			break;
+		buffer.append(data, n);
+
+		size_t end;
+		while ((end = buffer.find('\n')) != string::npos)
+		{
+			istringstream line(buffer.substr(0, end));
+			buffer.erase(0, end + 1);
+
+			string command;
+			if (!(line >> command))
+				continue;
+
+			if (command == "quit")
+			{
+				session->Close();
+				return;
+			}
+
+			if (session->isBusy)
+			{
+				session->Send("error busy");
+				continue;
+			}
+
+			Game &game = session->game;
+			if (command == "position" || command == "play")
+			{
+				if (command == "position")
+					game.Reset();
+
+				string move;
+				bool isValid = true;
+				while (isValid && line >> move)
+				{
+					int id = Game::Str2Id(move);
+					isValid = (id != -1 && game.PutChess(id));
+				}
+				session->Send(isValid ? "ok" : "error invalid move " + move);
+			}
+			else if (command == "go" || command == "analyze")
+			{
+				Request request;
+				request.session = session;
+				request.isAnalyze = (command == "analyze");
+				request.searchTime = 0;
+				request.moveNum = ANALYZE_MOVE_NUM;
+				request.usedTime = 0;
+				request.bestMove = -1;
+
+				line >> request.searchTime >> request.moveNum;
+				request.moveNum = min(max(request.moveNum, 1), ANALYZE_MOVE_MAX);
+
+				if (request.searchTime <= 0)
+				{
+					session->Send("error time is expected");
+					continue;
+				}
+				if (game.GetState() != GameBase::E_NORMAL)
+				{
+					session->Send("error game is over");
+					continue;
+				}
+
+				request.deadline = Clock::now() + chrono::milliseconds(request.searchTime);
+				session->isBusy = true;
+				scheduler->Post(move(request));
+			}
+			else
+			{
+				session->Send("error unknown command " + command);
+			}
+		}
+	}
+
+	session->Close();
+}
+
+int Listen(const ServerConfig &config)
+{
+	int fd;
+	if (config.port > 0)
+	{
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		int enable = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(config.port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if (bind(fd, (sockaddr*)&address, sizeof(address)) != 0)
+			return -1;
+		printf("listening on 127.0.0.1:%d\n", config.port);
+	}
+	else
+	{
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(config.socketPath);
+
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, config.socketPath, sizeof(address.sun_path) - 1);
+
+		if (bind(fd, (sockaddr*)&address, sizeof(address)) != 0)
+			return -1;
+		printf("listening on %s\n", config.socketPath);
+	}
+
+	if (listen(fd, 64) != 0)
+		return -1;
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	ServerConfig config;
+
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "--socket") == 0)
+			config.socketPath = argv[i + 1];
+		else if (strcmp(argv[i], "--port") == 0)
+			config.port = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--threads") == 0)
+			config.threadNum = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--slice") == 0)
+			config.sliceTime = max(atoi(argv[i + 1]), 1);
+		else if (strcmp(argv[i], "--memory") == 0)
+			config.memory = atoi(argv[i + 1]);
+		else
+		{
+			printf("usage: gobang_server [--socket path | --port N] [--threads N] [--slice ms] [--memory MB per game, default %d]\n", SESSION_MEMORY);
+			return 1;
+		}
+	}
+
+	int listenFd = Listen(config);
+	if (listenFd < 0)
+	{
+		perror("gobang_server");
+		return 1;
+	}
+
+	Scheduler scheduler(config);
+
+	while (true)
+	{
+		int fd = accept(listenFd, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		auto session = make_shared<Session>(fd, config);
+		thread(ConnectionThread, session, fd, &scheduler).detach();
+	}
+
+	return 0;
+}
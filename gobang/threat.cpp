@@ -0,0 +1,204 @@
+#include <algorithm>
+#include "threat.h"
+
+ThreatSolver::ThreatSolver()
+{
+	nodeCount = 0;
+	nodeLimit = 0;
+}
+
+int ThreatSolver::Solve(GameBase &game, int type, int depth, int nodeLimit)
+{
+	if (game.state != GameBase::E_NORMAL)
+		return -1;
+
+	attackSide = game.GetSide();
+	defendSide = 3 - attackSide;
+	attackIndex = (attackSide == Board::E_BLACK) ? 0 : 1;
+	defendIndex = 1 - attackIndex;
+	useThree = (type == E_VCT);
+
+	nodeCount = 0;
+	this->nodeLimit = nodeLimit;
+	failTable.clear();
+
+	int move = -1;
+	if (!Attack(game.board, depth, move))
+		return -1;
+
+	return move;
+}
+
+bool ThreatSolver::Attack(const Board &board, int depth, int &move)
+{
+	int count;
+	int fivePoint = GetFivePoint(board, attackIndex, count);
+	if (count > 0)
+	{
+		move = fivePoint;
+		return true;
+	}
+
+	if (depth == 0 || ++nodeCount > nodeLimit)
+		return false;
+
+	auto it = failTable.find(board.hashKey);
+	if (it != failTable.end() && it->second >= depth)
+		return false;
+
+	array<uint8_t, GRID_NUM> moves;
+	int moveCount;
+
+	int blockPoint = GetFivePoint(board, defendIndex, count);
+	if (count > 1)
+		return false;
+
+	if (count == 1)
+	{
+		// opponent has a four, blocking it is the only move and it has to be a threat as well
+		if (board.gridType[attackIndex][blockPoint] == Board::E_RESTRICTED)
+			return false;
+
+		moves[0] = blockPoint;
+		moveCount = 1;
+	}
+	else
+	{
+		moveCount = GetAttackMoves(board, moves);
+	}
+
+	Board next;
+	for (int i = 0; i < moveCount; ++i)
+	{
+		PlayMove(board, moves[i], attackSide, next);
+
+		if (!useThree)
+		{
+			GetFivePoint(next, attackIndex, count);
+			if (count == 0)
+				continue; // not a four
+		}
+
+		if (Defend(next, depth - 1))
+		{
+			move = moves[i];
+			return true;
+		}
+
+		if (nodeCount > nodeLimit)
+			return false; // a failure caused by node limit is not stored
+	}
+
+	failTable[board.hashKey] = depth;
+	return false;
+}
+
+bool ThreatSolver::Defend(const Board &board, int depth)
+{
+	int count;
+	GetFivePoint(board, defendIndex, count);
+	if (count > 0)
+		return false; // opponent wins first
+
+	int blockPoint = GetFivePoint(board, attackIndex, count);
+	if (count > 1)
+		return true;
+
+	array<uint8_t, GRID_NUM> moves;
+	int moveCount;
+
+	if (count == 1)
+	{
+		if (board.gridType[defendIndex][blockPoint] == Board::E_RESTRICTED)
+			return true; // black can not block on a restricted move
+
+		moves[0] = blockPoint;
+		moveCount = 1;
+	}
+	else
+	{
+		if (!useThree)
+			return false;
+
+		// no threat if the attacker can not make an open four or 4 + 3 next move
+		if (!board.gridTypeSet[attackIndex][Board::E_OPEN_FOUR - Board::E_RESTRICTED].Any() &&
+			!board.gridTypeSet[attackIndex][Board::E_FOUR_THREE - Board::E_RESTRICTED].Any())
+			return false;
+
+		moveCount = GetDefendMoves(board, moves);
+	}
+
+	Board next;
+	int move;
+	for (int i = 0; i < moveCount; ++i)
+	{
+		PlayMove(board, moves[i], defendSide, next);
+
+		if (!Attack(next, depth, move))
+			return false;
+	}
+	return true;
+}
+
+void ThreatSolver::PlayMove(const Board &board, int id, int side, Board &result)
+{
+	result = board;
+	result.grids[id] = side;
+	result.UpdatScoreInfo(id, 0);
+}
+
+int ThreatSolver::GetFivePoint(const Board &board, int i0, int &count)
+{
+	const GridSet &grids = board.gridTypeSet[i0][Board::E_FIVE - Board::E_RESTRICTED];
+
+	int result = -1;
+	count = 0;
+	grids.ForEach([&](int id)
+	{
+		result = id;
+		++count;
+	});
+	return result;
+}
+
+int ThreatSolver::GetAttackMoves(const Board &board, array<uint8_t, GRID_NUM> &moves)
+{
+	int minScore = useThree ? OPEN_THREE_SCORE : CLOSE_FOUR_SCORE;
+
+	// every grid with a four or an open three is in one of these types
+	GridSet grids;
+	for (int type = Board::E_FIVE; type <= Board::E_OPEN_THREE; ++type)
+		grids |= board.gridTypeSet[attackIndex][type - Board::E_RESTRICTED];
+
+	int count = 0;
+	grids.ForEach([&](int id)
+	{
+		if (board.scoreInfo[attackIndex][id] >= minScore)
+			moves[count++] = id;
+	});
+
+	// strongest threats first
+	sort(moves.begin(), moves.begin() + count, [&board, this](uint8_t a, uint8_t b)
+	{
+		return board.scoreInfo[attackIndex][a] > board.scoreInfo[attackIndex][b];
+	});
+	return count;
+}
+
+int ThreatSolver::GetDefendMoves(const Board &board, array<uint8_t, GRID_NUM> &moves)
+{
+	// counter moves of the defender, and fours of its own which the attacker has to answer
+	GridSet grids = board.prioritySet[Board::E_HIGHEST];
+	grids |= board.prioritySet[Board::E_HIGH];
+
+	for (int type = Board::E_FIVE; type <= Board::E_OPEN_THREE; ++type)
+	{
+		board.gridTypeSet[defendIndex][type - Board::E_RESTRICTED].ForEach([&](int id)
+		{
+			if (board.scoreInfo[defendIndex][id] >= CLOSE_FOUR_SCORE)
+				grids.Set(id);
+		});
+	}
+
+	return grids.ToArray(moves);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <unordered_map>
+#include "game.h"
+
+// threat space search, the side to move tries to win by moves the opponent must answer
+// VCF only plays fours, VCT plays open threes as well, every answer of the opponent is searched
+// a win found by VCT is as reliable as the counter moves given by UpdateGridsInfo, a VCF win is always real
+class ThreatSolver
+{
+public:
+	enum Type
+	{
+		E_VCF,
+		E_VCT,
+	};
+
+	ThreatSolver();
+
+	int Solve(GameBase &game, int type, int depth, int nodeLimit); // winning move, -1 if none is found
+	int GetNodeCount() { return nodeCount; }
+
+private:
+	bool Attack(const Board &board, int depth, int &move);
+	bool Defend(const Board &board, int depth);
+
+	void PlayMove(const Board &board, int id, int side, Board &result);
+	int GetFivePoint(const Board &board, int i0, int &count);
+	int GetAttackMoves(const Board &board, array<uint8_t, GRID_NUM> &moves);
+	int GetDefendMoves(const Board &board, array<uint8_t, GRID_NUM> &moves);
+
+	int attackSide, defendSide;
+	int attackIndex, defendIndex; // index of scoreInfo and grid types
+	bool useThree;
+	int nodeCount, nodeLimit;
+	unordered_map<uint64_t, int> failTable; // position hash -> deepest depth that failed
+};